@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Pairs/s against list size, row at a time and tiled. Big lists only
+# scan enough rows to compare about $pairs pairs.
+
+pairs=500000000
+dir=wrk/tile
+
+mkdir -p $dir
+make fdmf_correlator || exit 1
+
+for n in 10000 100000 1000000 10000000; do
+  dump=$dir/r$n.bin
+  if [ ! -f $dump ]; then
+    perl -e 'open R, "<", "/dev/urandom" or die;
+      $n = shift; print unpack( "H*", $b ), "\n"
+        while $n-- > 0 && read R, $b, 96' $n \
+      | ./fdmf_correlator --binary $dump
+  fi
+  rows=$(( pairs / n ))
+  for tile in --no-tile ''; do
+    echo -n "$n ${tile:---tile}: "
+    ./fdmf_correlator -v --rows $rows $tile $dump 2>&1 > /dev/null \
+      | tr '\r' '\n' | grep Compared
+  done
+done
+
+# vim:ts=2:sw=2:sts=2:et:ft=sh
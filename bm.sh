@@ -19,7 +19,7 @@ mv *.gcov $bmdir
 
 # Now do a performance test
 make clean && make
-for keep in 10 100 1000 10000 100000; do
+for keep in 10 100 1000 10000 100000 1000000; do
   log=$bmdir/t$keep.bm
   set -x
   $timer -o $log ./fdmf_correlator -v --keep $keep $dump > /dev/null
@@ -27,5 +27,26 @@ for keep in 10 100 1000 10000 100000; do
   cat $log
 done
 
+# Compare the distance kernels this CPU supports
+for kernel in $(./fdmf_correlator --kernel list | grep -v unsupported); do
+  log=$bmdir/k$kernel.bm
+  set -x
+  $timer -o $log ./fdmf_correlator -v --kernel $kernel --keep 1000 $dump > /dev/null
+  set +x
+  cat $log
+done
+
+# How often giving up early pays against the whole distance
+for kernel in popcnt scalar table; do
+  for abort in '' --early-abort; do
+    log=$bmdir/a$kernel${abort:+-early}.bm
+    set -x
+    $timer -o $log ./fdmf_correlator -v --kernel $kernel $abort --keep 1000 \
+      $dump 2>&1 > /dev/null | tr '\r' '\n' | grep -E '^(Compared|Gave)'
+    set +x
+    cat $log
+  done
+done
+
 # vim:ts=2:sw=2:sts=2:et:ft=sh
 
@@ -5,34 +5,302 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
 
 #define PROG "fdmf_correlator"
-#define HASH_LEN 768
-#define HASH_BYTES (HASH_LEN / 8)
-#define HASH_CHARS (HASH_LEN / 4)
+#define DEFAULT_HASH_LEN 768
+#define MAX_HASH_LEN 1024
+#define MAX_HASH_BYTES (MAX_HASH_LEN / 8)
+#define MAX_HASH_CHARS (MAX_HASH_LEN / 4)
+#define HASH_LENS 4             /* lengths supported, see hash_lens[] */
 #define SUMMARY_LEN 8
-#define SUMMARY_SPAN (HASH_BYTES/SUMMARY_LEN)
+#define SEGMENTS 4              /* pieces of a hash for bounded kernels */
+#define SEGMENT_SPANS (SUMMARY_LEN / SEGMENTS)
+#define CACHE_LINE 64
+#define MIN_PARTS ((hash_len + 63) / 64)        /* substrings fit a uint64_t */
+#define MIN_SUBSTRING 16        /* narrowest substring the index picks */
+#define PROBE_COST 8            /* comparisons a probe takes as long as */
+#define TILE_ROWS 512           /* rows compared with a tile, fit in L2 */
+#define TILE_COLS 128           /* hashes in a tile, fit in L1 */
+#define WRITER_BUF 65536
+#define SORT_RUN 65536          /* pairs sorted in memory at once */
+#define SORT_FANIN 16           /* runs merged at once */
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/* All the hashes in one cache line aligned block with the per span bit
+ * counts that best_distance() needs packed separately so that both
+ * passes stream through memory.
+ */
 struct phash {
-  struct phash *next;
-  unsigned char bits[HASH_BYTES];
-  unsigned int summary[SUMMARY_LEN];
+  unsigned char *bits;          /* count * hash_bytes */
+  unsigned char *summary;       /* count * SUMMARY_LEN */
+  size_t count, size;
+  void *map;                    /* non NULL if mmapped from a dump */
+  size_t map_len;
+};
+
+/* A binary dump is this header, padded to DUMP_ALIGN, followed by the
+ * count hash_len bit hashes and then count packed summaries, all exactly
+ * as they're laid out in a struct phash and in the order they are
+ * compared in. Numbers are in native byte order. The magic starts with
+ * a byte that can't start a text dump.
+ */
+#define DUMP_MAGIC "\211FDMF\r\n\032"
+#define DUMP_VERSION 1
+#define DUMP_ALIGN CACHE_LINE
+
+struct dump_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t hash_len;            /* bits per hash */
+  uint32_t summary_len;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t bits_offset;
+  uint64_t summary_offset;
 };
 
 struct correlation {
-  const struct phash *pair[2];
+  unsigned int pair[2];         /* indexes into the phash */
   unsigned int distance;
 };
 
+/* A state file holds the pairs of a top_k, before they are resolved, so
+ * that a later run can add hashes to the end of the list and compare
+ * only the pairs that involve them, or so that the shards of a search
+ * can be merged. The checksum covers the hashes the pairs index. Numbers
+ * are in native byte order.
+ */
+#define STATE_MAGIC "\211FDMS\r\n\032"
+#define STATE_VERSION 2
+
+struct state_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t hash_len;
+  uint64_t keep;
+  uint64_t count;               /* hashes in the list */
+  uint64_t checksum;
+  uint64_t used;                /* pairs that follow */
+  uint32_t shard, shards;       /* which part of the search, 0/1 for all */
+};
+
+/* The hashes of a list with exact copies of earlier hashes removed.
+ * The first copy of each hash is kept, so unique is in list order, and
+ * the copies of a hash are linked from the first in list order.
+ */
+struct dedup {
+  struct phash unique;
+  unsigned *first;              /* index in the list of each unique hash */
+  unsigned *next;               /* next copy of each hash, or UINT_MAX */
+  size_t groups, copies;        /* hashes with copies and their copies */
+};
+
+/* Hashes joined into groups by the pairs between them, a union-find
+ * forest with each group's root at the top of its tree.
+ */
+struct groups {
+  unsigned *parent;             /* next hash towards the root */
+  unsigned *size;               /* of the tree under each root */
+  unsigned *degree;             /* pairs each hash is in */
+  size_t count;
+};
+
+/* The closest pairs found so far. The best keep pairs, ordered by
+ * distance and then by the position of the pair in the list, are held
+ * in a max heap with the worst of them at the root. The pairs that tie
+ * with the root but didn't make it into the heap go in a second heap
+ * ordered by position, which holds on to the earliest of them; between
+ * them the heaps have the first keep pairs at the cut-off distance.
+ * That's enough for resolve_correlation() to reproduce the order a
+ * single pass would have kept ties in, whatever order the pairs were
+ * visited in, which is what lets threads search independently and have
+ * their results merged.
+ */
+struct top_k {
+  struct correlation *heap, *ties;
+  size_t keep, used, nties;
+  size_t count[MAX_HASH_LEN + 1];   /* how many of each distance in heap */
+  unsigned int cutoff;          /* skip pairs at least this far apart */
+  unsigned int bound;           /* pairs this far apart can't be kept */
+  int ordered;                  /* pairs arrive in list order */
+};
+
+typedef int ( *correlation_cmp_fn ) ( const struct correlation * a,
+                                      const struct correlation * b );
+
+/* A multi-index hash splits each hash into parts substrings and files
+ * every hash under each of its substrings. Two hashes that are at most
+ * R apart must differ by at most R / parts bits in at least one
+ * substring, so the hashes filed under keys that near to one of a
+ * hash's substrings are all the candidates within radius R.
+ */
+struct mih_bucket {
+  uint64_t key;
+  unsigned first, count;        /* count == 0 means empty */
+};
+
+struct mih_part {
+  unsigned start, len;          /* range of bits */
+  unsigned shift;
+  size_t mask;
+  struct mih_bucket *bucket;
+  unsigned *entry;              /* hash indexes in bucket, ascending */
+};
+
+struct mih {
+  unsigned parts;
+  unsigned radius;              /* bits each substring is probed within */
+  struct mih_part *part;
+};
+
+/* How pairs are written */
+enum {
+  OUT_HEX,                      /* distance and both hashes in hex */
+  OUT_INDEX,                    /* distance and the index of each hash */
+  OUT_BINARY                    /* struct correlation */
+};
+
+/* Buffers output from one worker. Output is written in whole buffers
+ * so that lines from different workers don't get mixed up.
+ */
+struct writer {
+  pthread_mutex_t *lock;        /* NULL if not shared */
+  FILE *fl;
+  int format;                   /* OUT_* */
+  char *buf;
+  size_t used;
+};
+
+/* One of a hash's nearest neighbours */
+struct neighbour {
+  unsigned index, distance;
+};
+
+/* A run of consecutive rows of the pair triangle */
+struct chunk {
+  size_t first, rows;
+  unsigned long work;
+};
+
+/* Hashes first to first + count - 1 of a binary dump read from fd */
+struct block {
+  int fd;
+  const struct dump_header *hdr;
+  size_t first, count;
+  unsigned char *bits, *summary;
+  pthread_t thread;
+};
+
+/* How the pairs were dealt with */
+struct counts {
+  unsigned long examined;       /* pairs looked at */
+  unsigned long swept;          /* skipped in bulk by the sorted sweep */
+  unsigned long bounded;        /* skipped by best_distance() */
+  unsigned long evaluated;      /* whose distance was computed */
+  unsigned long aborted;        /* given up on part way through */
+  unsigned long segments;       /* of hashes compared */
+  unsigned long inserted;       /* offered to the closest pairs */
+  unsigned long distances[MAX_HASH_LEN + 1];    /* computed, by distance */
+  double busy;                  /* seconds spent comparing */
+  unsigned long found;          /* pairs streamed */
+};
+
+struct job {
+  pthread_mutex_t lock;
+  const struct phash *data;
+  const struct phash *query;    /* numbered after data, or NULL */
+  size_t count;                 /* hashes in data and query */
+  size_t searched;              /* hashes searched, not all in data */
+  const struct mih *index;      /* NULL to compare every pair */
+  unsigned radius;
+  unsigned bound;               /* pairs this far apart aren't wanted */
+  size_t from;                  /* only pairs with a hash from here on */
+  int cross;                    /* and only with one before it as well */
+  unsigned knn;                 /* neighbours per hash, 0 for top-K */
+  FILE *stream;                 /* write pairs here as they're found */
+  int spill;                    /* stream is a temporary file to sort */
+  int format;                   /* how to write pairs, OUT_* */
+  int sweep;                    /* visit pairs in popcount order */
+  int tiled;                    /* compare blocks of rows and columns */
+  size_t start, end;            /* rows of the pair triangle to scan */
+  struct phash sorted;          /* the hashes in popcount order */
+  unsigned *order;              /* index in data of each sorted hash */
+  unsigned short *pop;          /* popcount of each sorted hash */
+  struct neighbour *neighbour;  /* count * knn */
+  unsigned *nneighbour;
+  struct chunk *chunk;
+  size_t nchunks, next;
+  unsigned long done, total;
+  struct counts n;
+  struct counts *thread;        /* each thread's share of n, or NULL */
+  unsigned int lastpc;
+  size_t lastused;
+};
+
+struct worker {
+  pthread_t thread;
+  struct job *job;
+  struct top_k top;
+  struct counts n;
+  unsigned *seen, *cand;        /* scratch for index_row() */
+  struct writer out;
+};
+
+typedef void ( *summary_fn ) ( const unsigned char *hash,
+                              unsigned char *sum );
+
+typedef unsigned int ( *distance_fn ) ( const unsigned char *a,
+                                        const unsigned char *b );
+
+typedef unsigned int ( *bounded_fn ) ( const unsigned char *a,
+                                       const unsigned char *b,
+                                       const unsigned char *sa,
+                                       const unsigned char *sb,
+                                       unsigned bound, unsigned limit,
+                                       unsigned *segments );
+
+/* A way of computing the Hamming distance between two hashes, and
+ * optionally of giving up once it's known to be at least some limit
+ */
+struct kernel {
+  const char *name;
+  distance_fn distance[HASH_LENS];      /* for each of hash_lens[] */
+  bounded_fn bounded[HASH_LENS];        /* or NULL */
+  int ( *supported ) ( void );
+};
+
 static int verbose = 0;
+static unsigned char bitcount[65536];
+static distance_fn distance_kernel;
+static bounded_fn bounded_kernel;
+
+/* Every hash in a run is the same length, which is taken from the first
+ * hash read and is one of these
+ */
+static const unsigned hash_lens[HASH_LENS] = { 256, 512, 768, 1024 };
+static unsigned hash_len, hash_bytes, hash_chars, length_index;
+static summary_fn summary_kernel;       /* for hashes of hash_len */
 
 static void
 mention( const char *msg, ... ) {
@@ -56,6 +324,13 @@ die( const char *msg, ... ) {
   exit( 1 );
 }
 
+static double
+now( void ) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 static unsigned int
 count_bits( unsigned int v ) {
   unsigned int c;
@@ -65,15 +340,37 @@ count_bits( unsigned int v ) {
   return c;
 }
 
-static unsigned int
-count_hash_bits( const unsigned char *hash, size_t bytes ) {
-  unsigned int i, c = 0;
-  for ( i = 0; i < bytes; i++ ) {
-    c += count_bits( hash[i] );
+/* The bit count of each of the SUMMARY_LEN spans of a hash of bytes
+ * bytes, compiled once for every length like the distance kernels.
+ * Spans are a whole number of 32 bit words at every length.
+ */
+static inline void __attribute__ ( ( always_inline ) )
+summarise( const unsigned char *hash, unsigned char *sum, unsigned bytes ) {
+  unsigned span = bytes / SUMMARY_LEN, i, j, c;
+  uint32_t w;
+  for ( i = 0; i < SUMMARY_LEN; i++ ) {
+    for ( c = 0, j = 0; j < span; j += sizeof( w ) ) {
+      memcpy( &w, hash + span * i + j, sizeof( w ) );
+      c += __builtin_popcount( w );
+    }
+    sum[i] = c;
   }
-  return c;
 }
 
+#define LENGTH_SUMMARY( bits ) \
+  static void \
+  summarise_ ## bits( const unsigned char *hash, unsigned char *sum ) { \
+    summarise( hash, sum, bits / 8 ); \
+  }
+LENGTH_SUMMARY( 256 )
+LENGTH_SUMMARY( 512 )
+LENGTH_SUMMARY( 768 )
+LENGTH_SUMMARY( 1024 )
+
+static const summary_fn summaries[HASH_LENS] = {
+  summarise_256, summarise_512, summarise_768, summarise_1024
+};
+
 static void *
 safe_malloc( size_t size ) {
   void *m = malloc( size );
@@ -83,22 +380,43 @@ safe_malloc( size_t size ) {
   return m;
 }
 
+static void
+set_hash_len( unsigned bits ) {
+  unsigned i;
+  if ( hash_len && bits != hash_len ) {
+    die( "Expected %u bit hashes, not %u", hash_len, bits );
+  }
+  for ( i = 0; i < HASH_LENS && hash_lens[i] != bits; i++ ) {
+  }
+  if ( i == HASH_LENS ) {
+    die( "Unsupported hash length of %u bits", bits );
+  }
+  hash_len = bits;
+  hash_bytes = bits / 8;
+  hash_chars = bits / 4;
+  length_index = i;
+  summary_kernel = summaries[i];
+}
+
 static int
-read_hash( FILE * fl, unsigned char hash[HASH_BYTES] ) {
-  memset( hash, 0, HASH_BYTES );
-  int hp = 0;
+read_hash( FILE * fl, unsigned char hash[MAX_HASH_BYTES] ) {
+  memset( hash, 0, MAX_HASH_BYTES );
+  unsigned hp = 0;
   for ( ;; ) {
     int v, c = fgetc( fl );
     if ( c == EOF ) {
       return 0;
     }
     if ( c == '\n' ) {
-      if ( hp != HASH_CHARS ) {
+      if ( !hash_len ) {
+        set_hash_len( hp * 4 );
+      }
+      if ( hp != hash_chars ) {
         die( "Hash too short" );
       }
       return 1;
     }
-    if ( hp > HASH_CHARS ) {
+    if ( hp >= ( hash_len ? hash_chars : MAX_HASH_CHARS ) ) {
       die( "Hash too long" );
     }
     if ( c < 0 || c > 255 || !isxdigit( c ) ) {
@@ -110,276 +428,3011 @@ read_hash( FILE * fl, unsigned char hash[HASH_BYTES] ) {
   }
 }
 
-static struct phash *
-new_phash( const unsigned char *hash, struct phash *next ) {
-  int i = 0;
-  struct phash *ph = safe_malloc( sizeof( struct phash ) );
-  ph->next = next;
-  memcpy( ph->bits, hash, HASH_BYTES );
-  for ( i = 0; i < SUMMARY_LEN; i++ ) {
-    ph->summary[i] =
-        count_hash_bits( ph->bits + SUMMARY_SPAN * i, SUMMARY_SPAN );
+static void *
+safe_aligned_malloc( size_t size ) {
+  void *m;
+  if ( posix_memalign( &m, CACHE_LINE, MAX( size, 1 ) ) ) {
+    die( "Out of memory for %lu bytes", ( unsigned long ) size );
   }
-  return ph;
+  return m;
 }
 
-static struct phash *
-read_file( FILE * fl, size_t * count ) {
-  struct phash *data = NULL;
-  unsigned char hash[HASH_BYTES];
-  for ( ;; ) {
-    if ( !read_hash( fl, hash ) )
-      break;
-    data = new_phash( hash, data );
-    if ( count ) {
-      ( *count )++;
+static void *
+grow_aligned( void *m, size_t used, size_t size ) {
+  void *nm = safe_aligned_malloc( size );
+  memcpy( nm, m, used );
+  free( m );
+  return nm;
+}
+
+static void
+init_phash( struct phash *ph ) {
+  ph->size = 1024;
+  ph->count = 0;
+  ph->map = NULL;
+  /* The hash length may not be known yet */
+  ph->bits = safe_aligned_malloc( ph->size * MAX_HASH_BYTES );
+  ph->summary = safe_aligned_malloc( ph->size * SUMMARY_LEN );
+}
+
+static void
+add_phash( struct phash *ph, const unsigned char *hash ) {
+  if ( ph->count == ph->size ) {
+    if ( ph->size * 2 > UINT_MAX ) {
+      die( "Too many hashes" );
     }
+    ph->bits = grow_aligned( ph->bits, ph->count * hash_bytes,
+                             ph->size * 2 * hash_bytes );
+    ph->summary = grow_aligned( ph->summary, ph->count * SUMMARY_LEN,
+                                ph->size * 2 * SUMMARY_LEN );
+    ph->size *= 2;
   }
-  return data;
+
+  memcpy( ph->bits + ph->count * hash_bytes, hash, hash_bytes );
+  summary_kernel( hash, ph->summary + ph->count * SUMMARY_LEN );
+  ph->count++;
 }
 
+/* Hashes used to be pushed onto the front of a linked list and the
+ * order they're compared in decides how ties are reported so keep the
+ * last hash read first.
+ */
 static void
-free_phash( struct phash *ph ) {
-  struct phash *next;
-  while ( ph ) {
-    next = ph->next;
-    free( ph );
-    ph = next;
+reverse_phash( struct phash *ph ) {
+  unsigned char tmp[MAX_HASH_BYTES];
+  size_t i, j;
+  for ( i = 0, j = ph->count - 1; i < ph->count / 2; i++, j-- ) {
+    memcpy( tmp, ph->bits + i * hash_bytes, hash_bytes );
+    memcpy( ph->bits + i * hash_bytes, ph->bits + j * hash_bytes,
+            hash_bytes );
+    memcpy( ph->bits + j * hash_bytes, tmp, hash_bytes );
+    memcpy( tmp, ph->summary + i * SUMMARY_LEN, SUMMARY_LEN );
+    memcpy( ph->summary + i * SUMMARY_LEN, ph->summary + j * SUMMARY_LEN,
+            SUMMARY_LEN );
+    memcpy( ph->summary + j * SUMMARY_LEN, tmp, SUMMARY_LEN );
   }
 }
 
 static void
-hexdump( const unsigned char *data, size_t len ) {
-  unsigned int i;
-  for ( i = 0; i < len; i++ ) {
-    printf( "%02x", data[i] );
+free_phash( struct phash *ph ) {
+  if ( ph->map ) {
+    munmap( ph->map, ph->map_len );
+    ph->map = NULL;
+  }
+  else {
+    free( ph->bits );
+    free( ph->summary );
   }
+  ph->bits = ph->summary = NULL;
+  ph->count = ph->size = 0;
 }
 
-static struct correlation *
-new_correlation( size_t nent ) {
-  struct correlation *c;
-  unsigned i;
+static void
+init_dump_header( struct dump_header *hdr, size_t count ) {
+  memset( hdr, 0, sizeof( *hdr ) );
+  memcpy( hdr->magic, DUMP_MAGIC, sizeof( hdr->magic ) );
+  hdr->version = DUMP_VERSION;
+  hdr->hash_len = hash_len;
+  hdr->summary_len = SUMMARY_LEN;
+  hdr->count = count;
+  hdr->bits_offset = DUMP_ALIGN;
+  hdr->summary_offset = DUMP_ALIGN + ( uint64_t ) count * hash_bytes;
+}
 
-  c = safe_malloc( sizeof( struct correlation ) * nent );
-  for ( i = 0; i < nent; i++ ) {
-    c[i].pair[0] = c[i].pair[1] = NULL;
-    c[i].distance = UINT_MAX;
-  }
-  return c;
+static int
+is_dump_header( const struct dump_header *hdr ) {
+  return !memcmp( hdr->magic, DUMP_MAGIC, sizeof( hdr->magic ) );
 }
 
 static void
-free_correlation( struct correlation *c ) {
-  free( c );
+check_dump_header( const struct dump_header *hdr, uint64_t size ) {
+  struct dump_header want;
+  if ( hdr->version != DUMP_VERSION ) {
+    die( "Unsupported dump version %u", ( unsigned ) hdr->version );
+  }
+  if ( hdr->summary_len != SUMMARY_LEN ) {
+    die( "Dump has %u byte summaries, expected %u",
+         ( unsigned ) hdr->summary_len, SUMMARY_LEN );
+  }
+  set_hash_len( hdr->hash_len );
+  if ( hdr->count > UINT_MAX ) {
+    die( "Too many hashes" );
+  }
+  init_dump_header( &want, hdr->count );
+  if ( hdr->bits_offset != want.bits_offset
+       || hdr->summary_offset != want.summary_offset
+       || size < want.summary_offset + hdr->count * SUMMARY_LEN ) {
+    die( "Corrupt dump" );
+  }
+}
+
+/* If fd is a binary dump in a regular file map it directly */
+static int
+map_file( int fd, struct phash *ph ) {
+  struct dump_header hdr;
+  struct stat st;
+  void *map;
+
+  if ( fstat( fd, &st ) || !S_ISREG( st.st_mode )
+       || pread( fd, &hdr, sizeof( hdr ), 0 ) != sizeof( hdr )
+       || !is_dump_header( &hdr ) ) {
+    return 0;
+  }
+  check_dump_header( &hdr, st.st_size );
+
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  if ( MAP_FAILED == map ) {
+    die( "Can't map dump: %s", strerror( errno ) );
+  }
+
+  free_phash( ph );
+  ph->map = map;
+  ph->map_len = st.st_size;
+  ph->bits = ( unsigned char * ) map + hdr.bits_offset;
+  ph->summary = ( unsigned char * ) map + hdr.summary_offset;
+  ph->count = ph->size = hdr.count;
+  return 1;
 }
 
 static void
-show_correlation( const struct correlation *c, size_t nused ) {
-  unsigned i;
-  for ( i = 0; i < nused; i++ ) {
-    printf( "%5u ", c[i].distance );
-    hexdump( c[i].pair[0]->bits, HASH_BYTES );
-    printf( " " );
-    hexdump( c[i].pair[1]->bits, HASH_BYTES );
-    printf( "\n" );
+read_binary( FILE * fl, struct phash *ph ) {
+  struct dump_header hdr;
+  unsigned char pad[DUMP_ALIGN];
+
+  if ( fread( &hdr, sizeof( hdr ), 1, fl ) != 1 || !is_dump_header( &hdr ) ) {
+    die( "Bad dump header" );
+  }
+  check_dump_header( &hdr, UINT64_MAX );
+
+  free_phash( ph );
+  ph->count = ph->size = hdr.count;
+  ph->bits = safe_aligned_malloc( ph->count * hash_bytes );
+  ph->summary = safe_aligned_malloc( ph->count * SUMMARY_LEN );
+
+  if ( fread( pad, hdr.bits_offset - sizeof( hdr ), 1, fl ) != 1
+       || fread( ph->bits, hash_bytes, ph->count, fl ) != ph->count
+       || fread( ph->summary, SUMMARY_LEN, ph->count, fl ) != ph->count ) {
+    die( "Dump truncated" );
   }
 }
 
-#ifdef DEBUG
 static void
-sanity_check( const struct correlation *c, size_t nused ) {
-  unsigned i;
-  for ( i = 1; i < nused; i++ ) {
-    if ( c[i - 1].distance > c[i].distance ) {
-      show_correlation( c, nused );
-      die( "distance out of order at %u\n", i );
-    }
+read_text( FILE * fl, struct phash *ph ) {
+  unsigned char hash[MAX_HASH_BYTES];
+  for ( ;; ) {
+    if ( !read_hash( fl, hash ) )
+      break;
+    add_phash( ph, hash );
   }
+  reverse_phash( ph );
 }
 
+/* Read the header of the binary dump in fd without loading it */
 static void
-dump_phash( const struct phash *ph ) {
-  int i;
-  while ( ph ) {
-    hexdump( ph->bits, HASH_BYTES );
-    for ( i = 0; i < SUMMARY_LEN; i++ ) {
-      printf( " %3d", ph->summary[i] );
-    }
-    printf( "\n" );
-    ph = ph->next;
+read_dump_header( int fd, struct dump_header *hdr ) {
+  struct stat st;
+  if ( fstat( fd, &st ) || !S_ISREG( st.st_mode )
+       || pread( fd, hdr, sizeof( *hdr ), 0 ) != sizeof( *hdr )
+       || !is_dump_header( hdr ) ) {
+    die( "--budget needs a binary dump file, write one with --binary" );
   }
+  check_dump_header( hdr, st.st_size );
 }
-#endif
 
 static void
-insert_correlation( struct correlation *c, size_t nent, size_t * nused,
-                    const struct phash *this, const struct phash *that,
-                    unsigned distance ) {
-  unsigned lo, hi, mid = 0;
-  size_t nnew;
-  for ( lo = 0, hi = *nused; lo < hi; ) {
-    mid = ( lo + hi ) / 2;
-    if ( c[mid].distance < distance ) {
-      lo = ++mid;
-    }
-    else if ( c[mid].distance >= distance ) {
-      hi = mid;
+read_at( int fd, void *buf, size_t len, off_t offset ) {
+  ssize_t got;
+  for ( ; len; len -= got, offset += got, buf = ( char * ) buf + got ) {
+    if ( got = pread( fd, buf, len, offset ), got <= 0 ) {
+      die( "Can't read dump: %s", got ? strerror( errno ) : "truncated" );
     }
   }
+}
 
-  nnew = MIN( nent, *nused + 1 );
-  memmove( &c[mid + 1], &c[mid], ( nnew - 1 - mid ) * sizeof( c[0] ) );
-  c[mid].pair[0] = this;
-  c[mid].pair[1] = that;
-  c[mid].distance = distance;
-  *nused = nnew;
-
-#ifdef DEBUG
-  sanity_check( c, *nused );
-#endif
+static void *
+read_block( void *arg ) {
+  struct block *b = ( struct block * ) arg;
+  read_at( b->fd, b->bits, b->count * hash_bytes,
+           b->hdr->bits_offset + b->first * hash_bytes );
+  read_at( b->fd, b->summary, b->count * SUMMARY_LEN,
+           b->hdr->summary_offset + b->first * SUMMARY_LEN );
+  return NULL;
 }
 
+/* Binary dumps are mapped if possible, otherwise read */
 static void
-compute_bitcount( unsigned char *bitcount ) {
-  unsigned i;
-  for ( i = 0; i < 65536; i++ ) {
-    bitcount[i] = count_bits( i );
+read_file( FILE * fl, struct phash *ph ) {
+  int c;
+  if ( map_file( fileno( fl ), ph ) ) {
+    return;
+  }
+  c = fgetc( fl );
+  if ( c != EOF ) {
+    ungetc( c, fl );
+  }
+  if ( c == ( unsigned char ) DUMP_MAGIC[0] ) {
+    read_binary( fl, ph );
+  }
+  else {
+    read_text( fl, ph );
   }
 }
 
-static unsigned int
-hash_distance( const struct phash *pi, const struct phash *pj,
-               const unsigned char *bitcount ) {
-  unsigned i, distance = 0;
-  unsigned short *si = ( unsigned short * ) pi->bits;
-  unsigned short *sj = ( unsigned short * ) pj->bits;
-  for ( i = 0; i < HASH_BYTES / 2; i++ ) {
-    distance += bitcount[si[i] ^ sj[i]];
+static void
+write_binary( const char *name, const struct phash *ph ) {
+  struct dump_header hdr;
+  unsigned char pad[DUMP_ALIGN];
+  FILE *fl = fopen( name, "wb" );
+
+  if ( !fl ) {
+    die( "Can't write %s", name );
   }
-  return distance;
-}
 
-static unsigned int
-best_distance( const struct phash *pi, const struct phash *pj ) {
-  unsigned i, distance = 0;
-  for ( i = 0; i < SUMMARY_LEN; i++ ) {
-    distance += abs( ( int ) pi->summary[i] - ( int ) pj->summary[i] );
+  init_dump_header( &hdr, ph->count );
+  memset( pad, 0, sizeof( pad ) );
+  if ( fwrite( &hdr, sizeof( hdr ), 1, fl ) != 1
+       || fwrite( pad, hdr.bits_offset - sizeof( hdr ), 1, fl ) != 1
+       || fwrite( ph->bits, hash_bytes, ph->count, fl ) != ph->count
+       || fwrite( ph->summary, SUMMARY_LEN, ph->count, fl ) != ph->count
+       || fclose( fl ) ) {
+    die( "Error writing %s", name );
   }
-  return distance;
 }
 
-static unsigned long
-calc_work( const struct phash *data ) {
-  unsigned long total = 0, pass = 0;
-  const struct phash *pi;
-
-  /* The number we're after is count * (count - 1) / 2 - but since we
-   * don't have the count we might as well walk the list. This comment
-   * exists purely to demonstrate that I know how to calculate the
-   * number of iterations properly :)
-   */
+static const unsigned char *
+phash_bits( const struct phash *ph, size_t i ) {
+  return ph->bits + i * hash_bytes;
+}
+
+static const unsigned char *
+phash_summary( const struct phash *ph, size_t i ) {
+  return ph->summary + i * SUMMARY_LEN;
+}
 
-  for ( pi = data; pi; pi = pi->next ) {
-    total += pass++;
+/* The set that holds hash i of a list of the hashes in data followed by
+ * any queries, and in *base the number in the list of its first hash
+ */
+static const struct phash *
+hash_set( const struct phash *data, const struct phash *query, size_t i,
+          size_t *base ) {
+  if ( query && i >= data->count ) {
+    *base = data->count;
+    return query;
   }
-  return total;
+  *base = 0;
+  return data;
+}
+
+static const unsigned char *
+list_bits( const struct phash *data, const struct phash *query, size_t i ) {
+  size_t base;
+  const struct phash *ph = hash_set( data, query, i, &base );
+  return phash_bits( ph, i - base );
 }
 
+/* Add the hashes in more to the end of ph */
 static void
-progress( unsigned long done, unsigned long total, size_t used,
-          size_t size, unsigned int *lastpc, size_t * lastused ) {
-  unsigned int pc = 400 * done / total;
-  static char *spinner = "-\\|/";
-  if ( pc != *lastpc || used / 100 != *lastused / 100
-       || ( used == size && *lastused != size ) ) {
-    fprintf( stderr, "\r[%3u%%] %c correlations: %10lu / %10lu", pc / 4,
-             spinner[pc % 4], ( unsigned long ) used,
-             ( unsigned long ) size );
-    fflush( stderr );
-    *lastpc = pc;
-    *lastused = used;
+append_phash( struct phash *ph, const struct phash *more ) {
+  size_t i;
+
+  if ( ph->map ) {
+    struct phash copy;
+    init_phash( &copy );
+    for ( i = 0; i < ph->count; i++ ) {
+      add_phash( &copy, phash_bits( ph, i ) );
+    }
+    free_phash( ph );
+    *ph = copy;
+  }
+
+  for ( i = 0; i < more->count; i++ ) {
+    add_phash( ph, phash_bits( more, i ) );
   }
 }
 
-static struct correlation *
-correlate( const struct phash *data, size_t nent, size_t * nused ) {
-  struct correlation *c = new_correlation( nent );
-  const struct phash *pi, *pj;
-  unsigned distance;
-  unsigned char bitcount[65536];
-  unsigned long total = calc_work( data );
-  unsigned long done = 0;
-  unsigned int lastpc = -1;
-  size_t lastused = 0;
+/* FNV-1a over the first count hashes */
+static uint64_t
+checksum_phash( const struct phash *ph, size_t count ) {
+  const unsigned char *b = ph->bits;
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for ( i = 0; i < count * hash_bytes; i++ ) {
+    h = ( h ^ b[i] ) * 1099511628211ULL;
+  }
+  return h;
+}
 
-  *nused = 0;
+static uint64_t
+hash_key( const unsigned char *hash ) {
+  uint64_t key = 0, w;
+  unsigned i;
+  for ( i = 0; i < hash_bytes; i += sizeof( w ) ) {
+    memcpy( &w, hash + i, sizeof( w ) );
+    key = ( key ^ w ) * 0x9E3779B97F4A7C15ULL;
+  }
+  return key;
+}
 
-  compute_bitcount( bitcount );
+/* Find the hashes in data that are exact copies of an earlier one.
+ * Returns 0 if there are none, in which case dd is left empty.
+ */
+static int
+find_copies( struct dedup *dd, const struct phash *data ) {
+  size_t i, slot, size = 1, nu = 0;
+  unsigned bits = 0, u, *table, *last;
 
-  /* O(N^2) :) */
-  for ( pi = data; pi; pi = pi->next ) {
-    if ( verbose ) {
-      /* TODO is this called often enough? */
-      progress( done, total, *nused, nent, &lastpc, &lastused );
+  while ( size < data->count * 2 + 1 ) {
+    size <<= 1;
+    bits++;
+  }
+  table = safe_malloc( sizeof( unsigned ) * size );
+  for ( i = 0; i < size; i++ ) {
+    table[i] = UINT_MAX;
+  }
+  last = safe_malloc( sizeof( unsigned ) * MAX( data->count, 1 ) );
+  dd->first = safe_malloc( sizeof( unsigned ) * MAX( data->count, 1 ) );
+  dd->next = safe_malloc( sizeof( unsigned ) * MAX( data->count, 1 ) );
+  dd->groups = dd->copies = 0;
+
+  for ( i = 0; i < data->count; i++ ) {
+    const unsigned char *hash = phash_bits( data, i );
+    slot = hash_key( hash ) >> ( 64 - MAX( bits, 1 ) );
+    while ( u = table[slot], u != UINT_MAX
+            && memcmp( phash_bits( data, dd->first[u] ), hash,
+                       hash_bytes ) ) {
+      slot = ( slot + 1 ) & ( size - 1 );
     }
-    for ( pj = pi->next; pj; pj = pj->next ) {
-      done++;
-      if ( *nused == nent
-           && best_distance( pi, pj ) >= c[*nused - 1].distance ) {
-        continue;
-      }
-      distance = hash_distance( pi, pj, bitcount );
-      if ( *nused < nent || distance < c[*nused - 1].distance ) {
-        insert_correlation( c, nent, nused, pi, pj, distance );
+    if ( u == UINT_MAX ) {
+      table[slot] = u = nu++;
+      dd->first[u] = i;
+    }
+    else {
+      if ( last[u] == dd->first[u] ) {
+        dd->groups++;
       }
+      dd->next[last[u]] = i;
+      dd->copies++;
     }
+    dd->next[i] = UINT_MAX;
+    last[u] = i;
   }
-  if ( verbose ) {
-    progress( done++, total, *nused, nent, &lastpc, &lastused );
-    fprintf( stderr, "\n" );
+  free( table );
+  free( last );
+
+  init_phash( &dd->unique );
+  if ( !dd->copies ) {
+    free( dd->first );
+    free( dd->next );
+    dd->first = dd->next = NULL;
+    return 0;
   }
-  return c;
+  for ( u = 0; u < nu; u++ ) {
+    add_phash( &dd->unique, phash_bits( data, dd->first[u] ) );
+  }
+  return 1;
 }
 
 static void
-usage( void ) {
-  fprintf( stderr, "Usage: " PROG " [options] < dump\n\n"
-           "Options:\n"
-           "  -K, --keep    <N> Number of matches to keep (default 1000)\n"
-           "  -v, --verbose     Verbose output\n"
-           "  -h, --help        See this text\n" );
-  exit( 1 );
+free_dedup( struct dedup *dd ) {
+  free_phash( &dd->unique );
+  free( dd->first );
+  free( dd->next );
 }
 
-int
-main( int argc, char *argv[] ) {
-  struct phash *data;
+static struct correlation *
+new_correlation( size_t nent ) {
   struct correlation *c;
-  size_t nent = 1000, nused, count = 0;
-  int ch;
+  unsigned i;
 
-  static struct option opts[] = {
-    {"help", no_argument, NULL, 'h'},
-    {"verbose", no_argument, NULL, 'v'},
-    {"keep", required_argument, NULL, 'K'},
-    {NULL, 0, NULL, 0}
-  };
+  c = safe_malloc( sizeof( struct correlation ) * nent );
+  for ( i = 0; i < nent; i++ ) {
+    c[i].pair[0] = c[i].pair[1] = 0;
+    c[i].distance = UINT_MAX;
+  }
+  return c;
+}
 
-  while ( ch = getopt_long( argc, argv, "hvK:", opts, NULL ), ch != -1 ) {
-    switch ( ch ) {
-    case 'v':
-      verbose++;
-      break;
-    case 'K':
-      {
-        char *ep;
-        nent = strtod( optarg, &ep );
-        if ( *ep ) {
-          die( "Bad number" );
-        }
+static void
+free_correlation( struct correlation *c ) {
+  free( c );
+}
+
+static void
+init_writer( struct writer *wr, FILE * fl, int format,
+             pthread_mutex_t * lock ) {
+  wr->lock = lock;
+  wr->fl = fl;
+  wr->format = format;
+  wr->buf = safe_malloc( WRITER_BUF );
+  wr->used = 0;
+}
+
+static void
+flush_writer( struct writer *wr ) {
+  size_t rc;
+  if ( !wr->used ) {
+    return;
+  }
+  if ( wr->lock ) {
+    pthread_mutex_lock( wr->lock );
+  }
+  rc = fwrite( wr->buf, 1, wr->used, wr->fl );
+  if ( wr->lock ) {
+    pthread_mutex_unlock( wr->lock );
+  }
+  if ( rc != wr->used ) {
+    die( "Error writing pairs: %s", strerror( errno ) );
+  }
+  wr->used = 0;
+}
+
+static void
+free_writer( struct writer *wr ) {
+  flush_writer( wr );
+  free( wr->buf );
+  wr->buf = NULL;
+}
+
+/* Write n in decimal, right aligned in at least width characters */
+static char *
+put_number( char *p, unsigned n, unsigned width ) {
+  char digits[10];
+  unsigned len = 0;
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while ( n );
+  for ( ; width > len; width-- ) {
+    *p++ = ' ';
+  }
+  while ( len ) {
+    *p++ = digits[--len];
+  }
+  return p;
+}
+
+/* Pairs are written as "distance hash hash" lines, with the hashes in
+ * hex or as their index in the list, or as binary records
+ */
+static void
+write_pair( struct writer *wr, const struct phash *data,
+            const struct phash *query, const struct correlation *c ) {
+  static const char hex[] = "0123456789abcdef";
+  size_t len = wr->format == OUT_BINARY ? sizeof( *c )
+      : wr->format == OUT_INDEX ? 5 + 2 * 11 + 1 : 6 + hash_chars * 2 + 2;
+  char *p;
+  unsigned i, k;
+
+  if ( wr->used + len > WRITER_BUF ) {
+    flush_writer( wr );
+  }
+  p = wr->buf + wr->used;
+
+  if ( wr->format == OUT_BINARY ) {
+    memcpy( p, c, sizeof( *c ) );
+    wr->used += len;
+    return;
+  }
+
+  p = put_number( p, c->distance, 5 );
+  for ( k = 0; k < 2; k++ ) {
+    const unsigned char *h;
+    *p++ = ' ';
+    if ( wr->format == OUT_INDEX ) {
+      p = put_number( p, c->pair[k], 0 );
+      continue;
+    }
+    h = list_bits( data, query, c->pair[k] );
+    for ( i = 0; i < hash_bytes; i++ ) {
+      *p++ = hex[h[i] >> 4];
+      *p++ = hex[h[i] & 15];
+    }
+  }
+  *p++ = '\n';
+  wr->used = p - wr->buf;
+}
+
+static void
+show_correlation( const struct phash *data, const struct phash *query,
+                  const struct correlation *c, size_t nused, int format ) {
+  struct writer out;
+  size_t i;
+  init_writer( &out, stdout, format, NULL );
+  for ( i = 0; i < nused; i++ ) {
+    write_pair( &out, data, query, &c[i] );
+  }
+  free_writer( &out );
+}
+
+#ifdef DEBUG
+static void
+hexdump( const unsigned char *data, size_t len ) {
+  unsigned int i;
+  for ( i = 0; i < len; i++ ) {
+    printf( "%02x", data[i] );
+  }
+}
+
+static void
+sanity_check( const struct correlation *c, size_t nused ) {
+  unsigned i;
+  for ( i = 1; i < nused; i++ ) {
+    if ( c[i - 1].distance > c[i].distance ) {
+      die( "distance out of order at %u\n", i );
+    }
+  }
+}
+
+static void
+dump_phash( const struct phash *ph ) {
+  size_t n;
+  int i;
+  for ( n = 0; n < ph->count; n++ ) {
+    hexdump( phash_bits( ph, n ), hash_bytes );
+    for ( i = 0; i < SUMMARY_LEN; i++ ) {
+      printf( " %3d", phash_summary( ph, n )[i] );
+    }
+    printf( "\n" );
+  }
+}
+#endif
+
+static int
+position_cmp( const struct correlation *a, const struct correlation *b ) {
+  if ( a->pair[0] != b->pair[0] ) {
+    return a->pair[0] < b->pair[0] ? -1 : 1;
+  }
+  if ( a->pair[1] != b->pair[1] ) {
+    return a->pair[1] < b->pair[1] ? -1 : 1;
+  }
+  return 0;
+}
+
+static int
+correlation_cmp( const struct correlation *a, const struct correlation *b ) {
+  if ( a->distance != b->distance ) {
+    return a->distance < b->distance ? -1 : 1;
+  }
+  return position_cmp( a, b );
+}
+
+static int
+qsort_position_cmp( const void *a, const void *b ) {
+  return position_cmp( a, b );
+}
+
+/* The order show_correlation() lists pairs in when none are dropped */
+static int
+stream_cmp( const struct correlation *a, const struct correlation *b ) {
+  if ( a->distance != b->distance ) {
+    return a->distance < b->distance ? -1 : 1;
+  }
+  return position_cmp( b, a );
+}
+
+static int
+qsort_stream_cmp( const void *a, const void *b ) {
+  return stream_cmp( a, b );
+}
+
+static int
+qsort_correlation_cmp( const void *a, const void *b ) {
+  return correlation_cmp( a, b );
+}
+
+static void
+sift_up( struct correlation *h, size_t i, correlation_cmp_fn cmp ) {
+  struct correlation e = h[i];
+  while ( i > 0 ) {
+    size_t parent = ( i - 1 ) / 2;
+    if ( cmp( &h[parent], &e ) >= 0 ) {
+      break;
+    }
+    h[i] = h[parent];
+    i = parent;
+  }
+  h[i] = e;
+}
+
+static void
+sift_down( struct correlation *h, size_t n, correlation_cmp_fn cmp ) {
+  struct correlation e = h[0];
+  size_t i = 0, child;
+  while ( child = i * 2 + 1, child < n ) {
+    if ( child + 1 < n && cmp( &h[child + 1], &h[child] ) > 0 ) {
+      child++;
+    }
+    if ( cmp( &h[child], &e ) <= 0 ) {
+      break;
+    }
+    h[i] = h[child];
+    i = child;
+  }
+  h[i] = e;
+}
+
+static void
+init_top_k( struct top_k *tk, size_t keep ) {
+  tk->heap = new_correlation( MAX( keep, 1 ) );
+  tk->ties = new_correlation( MAX( keep, 1 ) );
+  tk->keep = keep;
+  tk->used = 0;
+  tk->nties = 0;
+  memset( tk->count, 0, sizeof( tk->count ) );
+  tk->cutoff = keep ? UINT_MAX : 0;
+  tk->bound = UINT_MAX;
+  tk->ordered = 1;
+}
+
+static void
+free_top_k( struct top_k *tk ) {
+  free_correlation( tk->heap );
+  free_correlation( tk->ties );
+}
+
+/* Hang on to a pair that ties with the root if it's one of the first
+ * keep pairs at that distance.
+ */
+static void
+add_tie( struct top_k *tk, const struct correlation *nc ) {
+  size_t room = tk->keep - tk->count[tk->heap[0].distance];
+  if ( tk->nties < room ) {
+    tk->ties[tk->nties] = *nc;
+    sift_up( tk->ties, tk->nties++, position_cmp );
+  }
+  else if ( tk->nties && position_cmp( nc, &tk->ties[0] ) < 0 ) {
+    tk->ties[0] = *nc;
+    sift_down( tk->ties, tk->nties, position_cmp );
+  }
+}
+
+/* If pairs arrive in list order any still to come are later in the list
+ * than the ones we have, so once there are keep pairs at the worst
+ * distance no more at that distance can get in. Otherwise they might.
+ */
+static void
+set_cutoff( struct top_k *tk ) {
+  unsigned worst;
+  if ( tk->used < tk->keep ) {
+    tk->cutoff = tk->bound;
+    return;
+  }
+  worst = tk->heap[0].distance;
+  tk->cutoff =
+      tk->ordered && tk->count[worst] + tk->nties >= tk->keep ? worst
+      : worst + 1;
+  tk->cutoff = MIN( tk->cutoff, tk->bound );
+}
+
+static void
+insert_top_k( struct top_k *tk, unsigned this, unsigned that,
+              unsigned distance ) {
+  struct correlation nc, root;
+
+  if ( !tk->keep ) {
+    return;
+  }
+
+  nc.pair[0] = this;
+  nc.pair[1] = that;
+  nc.distance = distance;
+  root = tk->heap[0];
+
+  if ( tk->used < tk->keep ) {
+    tk->heap[tk->used] = nc;
+    sift_up( tk->heap, tk->used++, correlation_cmp );
+    tk->count[distance]++;
+  }
+  else if ( correlation_cmp( &nc, &root ) < 0 ) {
+    tk->heap[0] = nc;
+    sift_down( tk->heap, tk->used, correlation_cmp );
+    tk->count[root.distance]--;
+    tk->count[distance]++;
+    if ( tk->heap[0].distance == root.distance ) {
+      add_tie( tk, &root );
+    }
+    else {
+      tk->nties = 0;
+    }
+  }
+  else if ( distance == root.distance ) {
+    add_tie( tk, &nc );
+  }
+
+  set_cutoff( tk );
+}
+
+/* Fold the pairs found by another worker into tk */
+static void
+merge_top_k( struct top_k *tk, struct top_k *other ) {
+  size_t i;
+  for ( i = 0; i < other->used; i++ ) {
+    insert_top_k( tk, other->heap[i].pair[0], other->heap[i].pair[1],
+                  other->heap[i].distance );
+  }
+  for ( i = 0; i < other->nties; i++ ) {
+    insert_top_k( tk, other->ties[i].pair[0], other->ties[i].pair[1],
+                  other->ties[i].distance );
+  }
+  free_top_k( other );
+}
+
+/* Add the pairs made of a copy of unique hash a and a copy of b, which
+ * are distance apart, to tk in list order. If a and b are the same
+ * hash add the pairs of its copies. Stop once no more would be kept.
+ */
+static void
+add_copies( struct top_k *tk, const struct dedup *dd, unsigned a,
+            unsigned b, unsigned distance ) {
+  unsigned x = dd->first[a], y = dd->first[b], o;
+  size_t added = 0;
+
+  if ( a == b ) {
+    for ( ; x != UINT_MAX; x = dd->next[x] ) {
+      for ( o = dd->next[x]; o != UINT_MAX; o = dd->next[o] ) {
+        if ( added++ == tk->keep || distance >= tk->cutoff ) {
+          return;
+        }
+        insert_top_k( tk, x, o, distance );
+      }
+    }
+    return;
+  }
+
+  /* Walk both lists of copies together pairing each copy with the later
+   * copies of the other hash. Once one runs out the rest of the other
+   * have nothing after them.
+   */
+  while ( x != UINT_MAX && y != UINT_MAX ) {
+    unsigned *this = x < y ? &x : &y, that = x < y ? y : x;
+    for ( o = that; o != UINT_MAX; o = dd->next[o] ) {
+      if ( added++ == tk->keep || distance >= tk->cutoff ) {
+        return;
+      }
+      insert_top_k( tk, *this, o, distance );
+    }
+    *this = dd->next[*this];
+  }
+}
+
+/* Turn the pairs found among the unique hashes into the pairs of the
+ * list that a search of the whole list would have kept. Every copy of a
+ * hash is 0 from the others. A pair of hashes stands for the pairs of
+ * their copies, the earliest of which is the pair of first copies, so
+ * only pairs kept among the unique hashes can have copies that are kept
+ * and only the first keep copies of each can be. The found top_k is
+ * freed.
+ */
+static void
+expand_copies( struct top_k *tk, struct top_k *found,
+               const struct dedup *dd ) {
+  size_t i, used = found->used + found->nties;
+  struct correlation *c =
+      safe_malloc( sizeof( struct correlation ) * MAX( used, 1 ) );
+
+  memcpy( c, found->heap, found->used * sizeof( c[0] ) );
+  memcpy( c + found->used, found->ties, found->nties * sizeof( c[0] ) );
+  qsort( c, used, sizeof( c[0] ), qsort_correlation_cmp );
+  init_top_k( tk, found->keep );
+  tk->ordered = 0;
+  free_top_k( found );
+
+  for ( i = 0; i < dd->unique.count; i++ ) {
+    if ( dd->next[dd->first[i]] != UINT_MAX ) {
+      add_copies( tk, dd, i, i, 0 );
+    }
+  }
+  for ( i = 0; i < used; i++ ) {
+    add_copies( tk, dd, c[i].pair[0], c[i].pair[1], c[i].distance );
+  }
+  free( c );
+}
+
+static void
+save_top_k( const char *name, const struct top_k *tk,
+            const struct phash *data, unsigned shard, unsigned shards ) {
+  struct state_header hdr;
+  FILE *fl = fopen( name, "wb" );
+
+  if ( !fl ) {
+    die( "Can't write %s", name );
+  }
+
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, STATE_MAGIC, sizeof( hdr.magic ) );
+  hdr.version = STATE_VERSION;
+  hdr.hash_len = hash_len;
+  hdr.keep = tk->keep;
+  hdr.count = data->count;
+  hdr.checksum = checksum_phash( data, data->count );
+  hdr.used = tk->used + tk->nties;
+  hdr.shard = shard;
+  hdr.shards = shards;
+  if ( fwrite( &hdr, sizeof( hdr ), 1, fl ) != 1
+       || fwrite( tk->heap, sizeof( tk->heap[0] ), tk->used,
+                  fl ) != tk->used
+       || fwrite( tk->ties, sizeof( tk->ties[0] ), tk->nties,
+                  fl ) != tk->nties || fclose( fl ) ) {
+    die( "Error writing %s", name );
+  }
+}
+
+/* Merge the pairs at most radius apart saved by an earlier run over the
+ * first count hashes of data into tk. The header is returned in hdr.
+ */
+static void
+load_top_k( const char *name, struct top_k *tk, const struct phash *data,
+            size_t count, unsigned radius, struct state_header *hdr ) {
+  struct correlation c;
+  uint64_t i;
+  FILE *fl = fopen( name, "rb" );
+
+  if ( !fl ) {
+    die( "Can't read %s", name );
+  }
+  if ( fread( hdr, sizeof( *hdr ), 1, fl ) != 1
+       || memcmp( hdr->magic, STATE_MAGIC, sizeof( hdr->magic ) ) ) {
+    die( "%s is not a state file", name );
+  }
+  if ( hdr->version != STATE_VERSION || hdr->hash_len != hash_len ) {
+    die( "Unsupported state file %s", name );
+  }
+  if ( hdr->count != count || hdr->checksum != checksum_phash( data, count ) ) {
+    die( "%s was saved for a different list of hashes", name );
+  }
+  if ( hdr->keep < tk->keep ) {
+    die( "%s only has the closest %lu pairs", name,
+         ( unsigned long ) hdr->keep );
+  }
+  if ( hdr->shard >= hdr->shards ) {
+    die( "%s is corrupt", name );
+  }
+
+  for ( i = 0; i < hdr->used; i++ ) {
+    if ( fread( &c, sizeof( c ), 1, fl ) != 1 ) {
+      die( "%s is truncated", name );
+    }
+    if ( c.pair[0] >= count || c.pair[1] >= count
+         || c.distance > hash_len ) {
+      die( "%s is corrupt", name );
+    }
+    if ( c.distance <= radius ) {
+      insert_top_k( tk, c.pair[0], c.pair[1], c.distance );
+    }
+  }
+  fclose( fl );
+}
+
+static void
+reverse_correlation( struct correlation *c, size_t nent ) {
+  size_t i;
+  for ( i = 0; i < nent / 2; i++ ) {
+    struct correlation t = c[i];
+    c[i] = c[nent - 1 - i];
+    c[nent - 1 - i] = t;
+  }
+}
+
+/* Reduce a top_k to the keep pairs that a single pass through the list
+ * would have chosen, in the order it would have left them in. A single
+ * pass only displaces a kept pair for one that is strictly closer and
+ * files each new pair ahead of any that it ties with. So of the pairs
+ * that tie at the final cut-off it keeps those found last before it had
+ * seen keep pairs at or within the cut-off, and it lists ties latest
+ * first. The top_k is freed.
+ */
+static struct correlation *
+resolve_correlation( struct top_k *tk, size_t * nused ) {
+  size_t i, first, ties, start, used = tk->used + tk->nties;
+  struct correlation *c =
+      safe_malloc( sizeof( struct correlation ) * MAX( used, 1 ) );
+
+  memcpy( c, tk->heap, tk->used * sizeof( c[0] ) );
+  memcpy( c + tk->used, tk->ties, tk->nties * sizeof( c[0] ) );
+  qsort( c, used, sizeof( c[0] ), qsort_correlation_cmp );
+  free_top_k( tk );
+
+  if ( used > tk->keep ) {
+    struct correlation *closer;
+    unsigned worst = c[tk->keep - 1].distance;
+
+    for ( first = tk->keep - 1; first > 0 && c[first - 1].distance == worst;
+          first-- ) {
+    }
+
+    closer = safe_malloc( sizeof( struct correlation ) * MAX( first, 1 ) );
+    memcpy( closer, c, first * sizeof( c[0] ) );
+    qsort( closer, first, sizeof( c[0] ), qsort_position_cmp );
+
+    /* Count the ties that are among the first keep pairs in list order */
+    for ( ties = 0, i = 0; first + ties < used; ties++ ) {
+      while ( i < first && position_cmp( &closer[i], &c[first + ties] ) < 0 ) {
+        i++;
+      }
+      if ( ties + 1 + i > tk->keep ) {
+        break;
+      }
+    }
+    free( closer );
+
+    memmove( &c[first], &c[first + ties - ( tk->keep - first )],
+             ( tk->keep - first ) * sizeof( c[0] ) );
+    used = tk->keep;
+  }
+
+  for ( start = 0, i = 1; i <= used; i++ ) {
+    if ( i == used || c[i].distance != c[start].distance ) {
+      reverse_correlation( c + start, i - start );
+      start = i;
+    }
+  }
+
+#ifdef DEBUG
+  sanity_check( c, used );
+#endif
+
+  *nused = used;
+  return c;
+}
+
+/* A sorted run of pairs in a temporary file being merged */
+struct run {
+  uint64_t next, end;           /* pairs still in the file */
+  struct correlation *buf;
+  size_t pos, len, size;
+};
+
+static int
+next_run( FILE * fl, struct run *r ) {
+  if ( r->pos == r->len ) {
+    if ( r->next == r->end ) {
+      return 0;
+    }
+    r->len = MIN( r->size, r->end - r->next );
+    if ( fseeko( fl, r->next * sizeof( r->buf[0] ), SEEK_SET )
+         || fread( r->buf, sizeof( r->buf[0] ), r->len, fl ) != r->len ) {
+      die( "Error reading pairs: %s", strerror( errno ) );
+    }
+    r->next += r->len;
+    r->pos = 0;
+  }
+  return 1;
+}
+
+/* Merge up to SORT_FANIN runs of runlen pairs, starting with pair first,
+ * into out.
+ */
+static void
+merge_runs( FILE * fl, uint64_t first, uint64_t last, uint64_t runlen,
+            struct correlation *mem, struct writer *out,
+            const struct phash *data, const struct phash *query ) {
+  struct run run[SORT_FANIN];
+  unsigned n, i, best;
+
+  for ( n = 0; n < SORT_FANIN && first < last; n++, first += runlen ) {
+    run[n].next = first;
+    run[n].end = MIN( first + runlen, last );
+    run[n].size = SORT_RUN / SORT_FANIN;
+    run[n].buf = mem + n * run[n].size;
+    run[n].pos = run[n].len = 0;
+  }
+
+  for ( ;; ) {
+    for ( best = n, i = 0; i < n; i++ ) {
+      if ( next_run( fl, &run[i] )
+           && ( best == n
+                || stream_cmp( &run[i].buf[run[i].pos],
+                               &run[best].buf[run[best].pos] ) < 0 ) ) {
+        best = i;
+      }
+    }
+    if ( best == n ) {
+      break;
+    }
+    write_pair( out, data, query, &run[best].buf[run[best].pos++] );
+  }
+}
+
+/* Sort the count pairs in fl, which is consumed, and write them to out
+ * in the order show_correlation() would have. Memory use is fixed: runs
+ * of SORT_RUN pairs are sorted and then merged SORT_FANIN at a time
+ * through further temporary files until there are few enough left to
+ * merge straight into out.
+ */
+static void
+sort_pairs( FILE * fl, uint64_t count, struct writer *out,
+            const struct phash *data, const struct phash *query ) {
+  struct correlation *mem = new_correlation( SORT_RUN );
+  uint64_t runlen, pos;
+  FILE *runs = tmpfile(  );
+  struct writer wr;
+  size_t len;
+
+  if ( !runs ) {
+    die( "Can't create temporary file: %s", strerror( errno ) );
+  }
+
+  rewind( fl );
+  init_writer( &wr, runs, OUT_BINARY, NULL );
+  while ( len = fread( mem, sizeof( mem[0] ), SORT_RUN, fl ), len ) {
+    qsort( mem, len, sizeof( mem[0] ), qsort_stream_cmp );
+    for ( pos = 0; pos < len; pos++ ) {
+      write_pair( &wr, data, query, &mem[pos] );
+    }
+  }
+  free_writer( &wr );
+  fclose( fl );
+
+  for ( runlen = SORT_RUN; runlen * SORT_FANIN < count;
+        runlen *= SORT_FANIN ) {
+    FILE *next = tmpfile(  );
+    if ( !next ) {
+      die( "Can't create temporary file: %s", strerror( errno ) );
+    }
+    init_writer( &wr, next, OUT_BINARY, NULL );
+    for ( pos = 0; pos < count; pos += runlen * SORT_FANIN ) {
+      merge_runs( runs, pos, count, runlen, mem, &wr, data, query );
+    }
+    free_writer( &wr );
+    fclose( runs );
+    runs = next;
+  }
+
+  merge_runs( runs, 0, count, runlen, mem, out, data, query );
+  fclose( runs );
+  free_correlation( mem );
+}
+
+static void
+compute_bitcount( void ) {
+  unsigned i;
+  for ( i = 0; i < 65536; i++ ) {
+    bitcount[i] = count_bits( i );
+  }
+}
+
+/* Each kernel is written for hashes of bytes bytes and compiled once for
+ * every length, with bytes a constant, so that the loops are unrolled as
+ * they were when the length was fixed.
+ */
+#define KERNEL_ATTR __attribute__ ( ( always_inline ) )
+#define LENGTH_KERNEL( kernel, attr, bits ) \
+  static unsigned int attr \
+  kernel ## _ ## bits( const unsigned char *a, const unsigned char *b ) { \
+    return kernel( a, b, bits / 8 ); \
+  }
+#define LENGTH_KERNELS( kernel, attr ) \
+  LENGTH_KERNEL( kernel, attr, 256 ) \
+  LENGTH_KERNEL( kernel, attr, 512 ) \
+  LENGTH_KERNEL( kernel, attr, 768 ) \
+  LENGTH_KERNEL( kernel, attr, 1024 )
+#define KERNELS_OF( kernel ) \
+  { kernel ## _256, kernel ## _512, kernel ## _768, kernel ## _1024 }
+
+/* The bounded kernels work through the hash a segment of summary spans
+ * at a time. The difference in the bit counts of each span is a lower
+ * bound on its distance, so bound, the sum of them from best_distance(),
+ * less those of the segments done so far is a lower bound on the rest.
+ * Once the distance so far plus that reaches limit the pair can't be
+ * wanted, and that sum is returned instead of the distance.
+ */
+#define BOUNDED_KERNEL( kernel, attr, bits ) \
+  static unsigned int attr \
+  kernel ## _ ## bits( const unsigned char *a, const unsigned char *b, \
+                       const unsigned char *sa, const unsigned char *sb, \
+                       unsigned bound, unsigned limit, \
+                       unsigned *segments ) { \
+    return kernel( a, b, sa, sb, bound, limit, segments, bits / 8 ); \
+  }
+#define BOUNDED_KERNELS( kernel, attr ) \
+  BOUNDED_KERNEL( kernel, attr, 256 ) \
+  BOUNDED_KERNEL( kernel, attr, 512 ) \
+  BOUNDED_KERNEL( kernel, attr, 768 ) \
+  BOUNDED_KERNEL( kernel, attr, 1024 )
+
+static inline unsigned int KERNEL_ATTR
+segment_bound( const unsigned char *sa, const unsigned char *sb ) {
+  unsigned i, bound = 0;
+  for ( i = 0; i < SEGMENT_SPANS; i++ ) {
+    bound += abs( ( int ) sa[i] - ( int ) sb[i] );
+  }
+  return bound;
+}
+
+static inline unsigned int KERNEL_ATTR
+table_distance( const unsigned char *a, const unsigned char *b,
+                unsigned bytes ) {
+  unsigned i, distance = 0;
+  const unsigned short *si = ( const unsigned short * ) a;
+  const unsigned short *sj = ( const unsigned short * ) b;
+  for ( i = 0; i < bytes / 2; i++ ) {
+    distance += bitcount[si[i] ^ sj[i]];
+  }
+  return distance;
+}
+
+LENGTH_KERNELS( table_distance, )
+
+static inline unsigned int KERNEL_ATTR
+table_bounded( const unsigned char *a, const unsigned char *b,
+               const unsigned char *sa, const unsigned char *sb,
+               unsigned bound, unsigned limit, unsigned *segments,
+               unsigned bytes ) {
+  const unsigned short *si = ( const unsigned short * ) a;
+  const unsigned short *sj = ( const unsigned short * ) b;
+  unsigned i, s, distance = 0, step = bytes / 2 / SEGMENTS;
+  for ( s = 0; s < SEGMENTS; s++ ) {
+    for ( i = 0; i < step; i++ ) {
+      distance += bitcount[si[i] ^ sj[i]];
+    }
+    bound -= segment_bound( sa, sb );
+    if ( distance + bound >= limit ) {
+      break;
+    }
+    si += step;
+    sj += step;
+    sa += SEGMENT_SPANS;
+    sb += SEGMENT_SPANS;
+  }
+  *segments = MIN( s + 1, SEGMENTS );
+  return distance + bound;
+}
+
+BOUNDED_KERNELS( table_bounded, )
+
+static inline unsigned int KERNEL_ATTR
+scalar_distance( const unsigned char *a, const unsigned char *b,
+                 unsigned bytes ) {
+  unsigned i, distance = 0;
+  for ( i = 0; i < bytes; i += 8 ) {
+    uint64_t x, y;
+    memcpy( &x, a + i, 8 );
+    memcpy( &y, b + i, 8 );
+    distance += __builtin_popcountll( x ^ y );
+  }
+  return distance;
+}
+
+LENGTH_KERNELS( scalar_distance, )
+
+static inline unsigned int KERNEL_ATTR
+scalar_bounded( const unsigned char *a, const unsigned char *b,
+                const unsigned char *sa, const unsigned char *sb,
+                unsigned bound, unsigned limit, unsigned *segments,
+                unsigned bytes ) {
+  unsigned i, s, distance = 0, step = bytes / SEGMENTS;
+  for ( s = 0; s < SEGMENTS; s++ ) {
+    for ( i = 0; i < step; i += 8 ) {
+      uint64_t x, y;
+      memcpy( &x, a + i, 8 );
+      memcpy( &y, b + i, 8 );
+      distance += __builtin_popcountll( x ^ y );
+    }
+    bound -= segment_bound( sa, sb );
+    if ( distance + bound >= limit ) {
+      break;
+    }
+    a += step;
+    b += step;
+    sa += SEGMENT_SPANS;
+    sb += SEGMENT_SPANS;
+  }
+  *segments = MIN( s + 1, SEGMENTS );
+  return distance + bound;
+}
+
+BOUNDED_KERNELS( scalar_bounded, )
+
+static int
+always_supported( void ) {
+  return 1;
+}
+
+#ifdef X86_KERNELS
+
+/* Same as scalar_distance but compiled to use the POPCNT instruction */
+static inline unsigned int KERNEL_ATTR __attribute__ ( ( target( "popcnt" ) ) )
+popcnt_distance( const unsigned char *a, const unsigned char *b,
+                 unsigned bytes ) {
+  unsigned i, distance = 0;
+  for ( i = 0; i < bytes; i += 8 ) {
+    uint64_t x, y;
+    memcpy( &x, a + i, 8 );
+    memcpy( &y, b + i, 8 );
+    distance += __builtin_popcountll( x ^ y );
+  }
+  return distance;
+}
+
+LENGTH_KERNELS( popcnt_distance, __attribute__ ( ( target( "popcnt" ) ) ) )
+
+static inline unsigned int KERNEL_ATTR __attribute__ ( ( target( "popcnt" ) ) )
+popcnt_bounded( const unsigned char *a, const unsigned char *b,
+                const unsigned char *sa, const unsigned char *sb,
+                unsigned bound, unsigned limit, unsigned *segments,
+                unsigned bytes ) {
+  return scalar_bounded( a, b, sa, sb, bound, limit, segments, bytes );
+}
+
+BOUNDED_KERNELS( popcnt_bounded, __attribute__ ( ( target( "popcnt" ) ) ) )
+
+static int
+popcnt_supported( void ) {
+  __builtin_cpu_init(  );
+  return __builtin_cpu_supports( "popcnt" );
+}
+
+/* AVX2 has no popcount so look up the count for each nibble with
+ * PSHUFB and sum the bytes with PSADBW.
+ */
+static inline unsigned int KERNEL_ATTR __attribute__ ( ( target( "avx2" ) ) )
+avx2_distance( const unsigned char *a, const unsigned char *b,
+               unsigned bytes ) {
+  const __m256i lut = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3,
+                                        1, 2, 2, 3, 2, 3, 3, 4,
+                                        0, 1, 1, 2, 1, 2, 2, 3,
+                                        1, 2, 2, 3, 2, 3, 3, 4 );
+  const __m256i nibble = _mm256_set1_epi8( 0x0f );
+  const __m256i zero = _mm256_setzero_si256(  );
+  __m256i sum = zero;
+  unsigned i;
+
+  for ( i = 0; i < bytes; i += 32 ) {
+    __m256i x =
+        _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i * ) ( a + i ) ),
+                          _mm256_loadu_si256( ( const __m256i * ) ( b + i ) ) );
+    __m256i lo = _mm256_shuffle_epi8( lut, _mm256_and_si256( x, nibble ) );
+    __m256i hi = _mm256_shuffle_epi8( lut,
+                                      _mm256_and_si256( _mm256_srli_epi16
+                                                        ( x, 4 ), nibble ) );
+    sum = _mm256_add_epi64( sum,
+                            _mm256_sad_epu8( _mm256_add_epi8( lo, hi ),
+                                             zero ) );
+  }
+
+  return _mm256_extract_epi64( sum, 0 ) + _mm256_extract_epi64( sum, 1 )
+      + _mm256_extract_epi64( sum, 2 ) + _mm256_extract_epi64( sum, 3 );
+}
+
+LENGTH_KERNELS( avx2_distance, __attribute__ ( ( target( "avx2" ) ) ) )
+
+static int
+avx2_supported( void ) {
+  __builtin_cpu_init(  );
+  return __builtin_cpu_supports( "avx2" );
+}
+
+/* Whole 512 bit words then a masked load for whatever is left */
+static inline unsigned int KERNEL_ATTR
+    __attribute__ ( ( target( "avx512f,avx512vpopcntdq" ) ) )
+avx512_distance( const unsigned char *a, const unsigned char *b,
+                 unsigned bytes ) {
+  __m512i sum = _mm512_setzero_si512(  );
+  unsigned i;
+
+  for ( i = 0; i + 64 <= bytes; i += 64 ) {
+    __m512i x = _mm512_xor_si512( _mm512_loadu_si512( a + i ),
+                                  _mm512_loadu_si512( b + i ) );
+    sum = _mm512_add_epi64( sum, _mm512_popcnt_epi64( x ) );
+  }
+  if ( i < bytes ) {
+    __mmask8 m = ( 1 << ( ( bytes - i ) / 8 ) ) - 1;
+    __m512i x = _mm512_xor_si512( _mm512_maskz_loadu_epi64( m, a + i ),
+                                  _mm512_maskz_loadu_epi64( m, b + i ) );
+    sum = _mm512_add_epi64( sum, _mm512_popcnt_epi64( x ) );
+  }
+
+  return _mm512_reduce_add_epi64( sum );
+}
+
+LENGTH_KERNELS( avx512_distance,
+                __attribute__ ( ( target( "avx512f,avx512vpopcntdq" ) ) ) )
+
+static int
+avx512_supported( void ) {
+  __builtin_cpu_init(  );
+  return __builtin_cpu_supports( "avx512f" )
+      && __builtin_cpu_supports( "avx512vpopcntdq" );
+}
+
+#endif
+
+/* In order of preference */
+static const struct kernel kernels[] = {
+#ifdef X86_KERNELS
+  {"avx512", KERNELS_OF( avx512_distance ), {NULL}, avx512_supported},
+  {"avx2", KERNELS_OF( avx2_distance ), {NULL}, avx2_supported},
+  {"popcnt", KERNELS_OF( popcnt_distance ), KERNELS_OF( popcnt_bounded ),
+   popcnt_supported},
+#endif
+  {"scalar", KERNELS_OF( scalar_distance ), KERNELS_OF( scalar_bounded ),
+   always_supported},
+  {"table", KERNELS_OF( table_distance ), KERNELS_OF( table_bounded ),
+   always_supported},
+  {NULL, {NULL}, {NULL}, NULL}
+};
+
+static const struct kernel *
+find_kernel( const char *name, int bounded ) {
+  const struct kernel *k;
+  for ( k = kernels; k->name; k++ ) {
+    if ( name ? !strcmp( name, k->name )
+         : k->supported(  ) && ( !bounded || k->bounded[0] ) ) {
+      return k;
+    }
+  }
+  return NULL;
+}
+
+static void
+list_kernels( void ) {
+  const struct kernel *k;
+  for ( k = kernels; k->name; k++ ) {
+    printf( "%-8s%s\n", k->name, k->supported(  ) ? "" : " (unsupported)" );
+  }
+}
+
+static const char *
+setup_kernel( const char *name, int bounded ) {
+  const struct kernel *k = find_kernel( name, bounded );
+  if ( !k ) {
+    die( "Unknown kernel %s", name );
+  }
+  if ( !k->supported(  ) ) {
+    die( "The %s kernel isn't supported by this CPU", name );
+  }
+  if ( bounded && !k->bounded[length_index] ) {
+    die( "The %s kernel can't --early-abort, try popcnt, scalar or table",
+         k->name );
+  }
+  compute_bitcount(  );
+  distance_kernel = k->distance[length_index];
+  bounded_kernel = bounded ? k->bounded[length_index] : NULL;
+  mention( "Using %s distance kernel for %u bit hashes%s", k->name,
+           hash_len, bounded_kernel ? ", giving up early" : "" );
+  return k->name;
+}
+
+static unsigned int
+best_distance( const unsigned char *si, const unsigned char *sj ) {
+  unsigned i, distance = 0;
+  for ( i = 0; i < SUMMARY_LEN; i++ ) {
+    distance += abs( ( int ) si[i] - ( int ) sj[i] );
+  }
+  return distance;
+}
+
+/* The distance between two hashes if it's less than limit, otherwise
+ * some number that's at least limit
+ */
+static inline unsigned int
+pair_distance( struct counts *n, const unsigned char *bi,
+               const unsigned char *si, const unsigned char *bj,
+               const unsigned char *sj, unsigned limit ) {
+  unsigned bound = best_distance( si, sj ), distance, segments;
+  if ( bound >= limit ) {
+    n->bounded++;
+    return bound;
+  }
+  n->evaluated++;
+  if ( !bounded_kernel ) {
+    distance = distance_kernel( bi, bj );
+    n->distances[distance]++;
+    return distance;
+  }
+  distance = bounded_kernel( bi, bj, si, sj, bound, limit, &segments );
+  n->segments += segments;
+  if ( segments < SEGMENTS ) {
+    n->aborted++;
+  }
+  else {
+    n->distances[distance]++;
+  }
+  return distance;
+}
+
+static void
+progress( unsigned long done, unsigned long total, size_t used,
+          size_t size, unsigned int *lastpc, size_t * lastused ) {
+  unsigned int pc = total ? 400 * done / total : 400;
+  static char *spinner = "-\\|/";
+  if ( pc != *lastpc || used / 100 != *lastused / 100
+       || ( used == size && *lastused != size ) ) {
+    fprintf( stderr, "\r[%3u%%] %c correlations: %10lu / %10lu", pc / 4,
+             spinner[pc % 4], ( unsigned long ) used,
+             ( unsigned long ) size );
+    fflush( stderr );
+    *lastpc = pc;
+    *lastused = used;
+  }
+}
+
+static uint64_t
+substring_key( const unsigned char *hash, unsigned start, unsigned len ) {
+  uint64_t key = 0;
+  unsigned b;
+  for ( b = start; b < start + len; b++ ) {
+    key = key << 1 | ( ( hash[b >> 3] >> ( 7 - ( b & 7 ) ) ) & 1 );
+  }
+  return key;
+}
+
+static struct mih_bucket *
+find_bucket( const struct mih_part *mp, uint64_t key ) {
+  size_t slot = ( key * 0x9E3779B97F4A7C15ULL ) >> mp->shift;
+  while ( mp->bucket[slot].count && mp->bucket[slot].key != key ) {
+    slot = ( slot + 1 ) & mp->mask;
+  }
+  return &mp->bucket[slot];
+}
+
+static void
+build_mih_part( struct mih_part *mp, const struct phash *data,
+                uint64_t * key, size_t base ) {
+  struct mih_bucket *b;
+  size_t i, size = 1, next = 0;
+  unsigned bits = 0;
+
+  while ( size < data->count + data->count / 2 + 1 ) {
+    size <<= 1;
+    bits++;
+  }
+  mp->shift = 64 - MAX( bits, 1 );
+  mp->mask = size - 1;
+  mp->bucket = safe_malloc( sizeof( struct mih_bucket ) * size );
+  memset( mp->bucket, 0, sizeof( struct mih_bucket ) * size );
+  mp->entry = safe_malloc( sizeof( unsigned ) * MAX( data->count, 1 ) );
+
+  for ( i = 0; i < data->count; i++ ) {
+    key[i] = substring_key( phash_bits( data, i ), mp->start, mp->len );
+    b = find_bucket( mp, key[i] );
+    b->key = key[i];
+    b->count++;
+  }
+
+  /* Point each bucket past its end then fill backwards so that the
+   * entries in each bucket end up in ascending order.
+   */
+  for ( i = 0; i < size; i++ ) {
+    next += mp->bucket[i].count;
+    mp->bucket[i].first = next;
+  }
+  for ( i = data->count; i-- > 0; ) {
+    b = find_bucket( mp, key[i] );
+    mp->entry[--b->first] = base + i;
+  }
+}
+
+/* Index the hashes in data, which are numbered from base on */
+static struct mih *
+new_mih( const struct phash *data, size_t base, unsigned parts,
+         unsigned radius ) {
+  struct mih *ix = safe_malloc( sizeof( struct mih ) );
+  uint64_t *key = safe_malloc( sizeof( uint64_t ) * MAX( data->count, 1 ) );
+  unsigned p;
+
+  ix->parts = parts;
+  ix->radius = radius / parts;
+  ix->part = safe_malloc( sizeof( struct mih_part ) * parts );
+  for ( p = 0; p < parts; p++ ) {
+    ix->part[p].start = p * hash_len / parts;
+    ix->part[p].len = ( p + 1 ) * hash_len / parts - ix->part[p].start;
+    build_mih_part( &ix->part[p], data, key, base );
+  }
+
+  free( key );
+  return ix;
+}
+
+static void
+free_mih( struct mih *ix ) {
+  unsigned p;
+  if ( !ix ) {
+    return;
+  }
+  for ( p = 0; p < ix->parts; p++ ) {
+    free( ix->part[p].bucket );
+    free( ix->part[p].entry );
+  }
+  free( ix->part );
+  free( ix );
+}
+
+/* The number of keys at most r bits from a len bit key */
+static double
+ball_size( unsigned len, unsigned r ) {
+  double c = 1, sum = 1;
+  unsigned k;
+  for ( k = 1; k <= r && k <= len; k++ ) {
+    c = c * ( len - k + 1 ) / k;
+    sum += c;
+  }
+  return sum;
+}
+
+/* The work per hash, in comparisons, of searching an index of parts
+ * substrings for hashes at most radius apart: a probe for every key near
+ * each of its substrings plus a comparison with every hash filed under
+ * one, taking the hashes to be random.
+ */
+static double
+mih_cost( size_t count, unsigned radius, unsigned parts ) {
+  unsigned len = hash_len / parts, b;
+  double filed = count;         /* hashes filed under each key */
+  for ( b = 0; b < len; b++ ) {
+    filed /= 2;
+  }
+  return parts * ball_size( len, radius / parts ) * ( PROBE_COST + filed );
+}
+
+/* The number of substrings that makes an index of count hashes cheapest
+ * to search, or 0 if making the row comparisons each row needs without
+ * it would be cheaper
+ */
+static unsigned
+choose_parts( size_t count, double row, unsigned radius ) {
+  unsigned p, best = MIN_PARTS;
+  for ( p = MIN_PARTS + 1; p <= hash_len / MIN_SUBSTRING; p++ ) {
+    if ( mih_cost( count, radius, p ) < mih_cost( count, radius, best ) ) {
+      best = p;
+    }
+  }
+  return mih_cost( count, radius, best ) < row ? best : 0;
+}
+
+static int
+unsigned_cmp( const void *a, const void *b ) {
+  unsigned ua = *( const unsigned * ) a, ub = *( const unsigned * ) b;
+  return ua < ub ? -1 : ua > ub;
+}
+
+/* The number of pairs in row i */
+static unsigned long
+row_work( const struct job *job, size_t i ) {
+  if ( job->knn ) {
+    return job->cross ? job->from : job->count - 1;
+  }
+  return job->count - MAX( i + 1, job->from );
+}
+
+/* Add the hashes from index from onwards filed under key that aren't
+ * already candidates for hash i.
+ */
+static size_t
+probe_key( struct worker *w, const struct mih_part *mp, uint64_t key,
+           size_t i, size_t from, size_t n ) {
+  const struct mih_bucket *b = find_bucket( mp, key );
+  const unsigned *e = mp->entry + b->first;
+  size_t lo = 0, hi = b->count, mid;
+
+  while ( lo < hi ) {
+    mid = ( lo + hi ) / 2;
+    if ( e[mid] < from ) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  for ( ; lo < b->count; lo++ ) {
+    if ( w->seen[e[lo]] != i + 1 ) {
+      w->seen[e[lo]] = i + 1;
+      w->cand[n++] = e[lo];
+    }
+  }
+  return n;
+}
+
+/* Hash i of the job, counting the queries after the hashes in data */
+static const unsigned char *
+job_bits( const struct job *job, size_t i ) {
+  return list_bits( job->data, job->query, i );
+}
+
+static const unsigned char *
+job_summary( const struct job *job, size_t i ) {
+  size_t base;
+  const struct phash *ph = hash_set( job->data, job->query, i, &base );
+  return phash_summary( ph, i - base );
+}
+
+/* Probe key and every key that differs from it by at most flips of the
+ * bits from low upwards, each of them once.
+ */
+static size_t
+probe_near( struct worker *w, const struct mih_part *mp, uint64_t key,
+            unsigned low, unsigned flips, size_t i, size_t from,
+            size_t n ) {
+  unsigned b;
+  n = probe_key( w, mp, key, i, from, n );
+  if ( flips ) {
+    for ( b = low; b < mp->len; b++ ) {
+      n = probe_near( w, mp, key ^ ( ( uint64_t ) 1 << b ), b + 1,
+                      flips - 1, i, from, n );
+    }
+  }
+  return n;
+}
+
+/* Collect the hashes from index from onwards, other than hash i, that
+ * have a substring near enough to one of hash i's in list order.
+ */
+static size_t
+index_candidates( struct worker *w, size_t i, size_t from ) {
+  const struct mih *ix = w->job->index;
+  const unsigned char *bi = job_bits( w->job, i );
+  size_t n = 0;
+  unsigned p;
+
+  w->seen[i] = i + 1;
+  for ( p = 0; p < ix->parts; p++ ) {
+    const struct mih_part *mp = &ix->part[p];
+    n = probe_near( w, mp, substring_key( bi, mp->start, mp->len ), 0,
+                    ix->radius, i, from, n );
+  }
+
+  qsort( w->cand, n, sizeof( w->cand[0] ), unsigned_cmp );
+  w->n.examined += n;
+  return n;
+}
+
+/* Check the later hashes that share a substring with hash i */
+static void
+index_row( struct worker *w, size_t i ) {
+  const struct job *job = w->job;
+  const unsigned char *bi = job_bits( job, i );
+  const unsigned char *si = job_summary( job, i );
+  const struct phash *cols;
+  unsigned limit, distance;
+  size_t k, base, from = MAX( i + 1, job->from );
+  size_t n = index_candidates( w, i, from );
+
+  cols = hash_set( job->data, job->query, from, &base );
+  for ( k = 0; k < n; k++ ) {
+    size_t j = w->cand[k] - base;
+    limit = MIN( w->top.cutoff, job->radius + 1 );
+    distance = pair_distance( &w->n, bi, si, phash_bits( cols, j ),
+                              phash_summary( cols, j ), limit );
+    if ( distance < limit ) {
+      insert_top_k( &w->top, i, base + j, distance );
+      w->n.inserted++;
+    }
+  }
+}
+
+static int
+neighbour_cmp( const struct neighbour *a, const struct neighbour *b ) {
+  if ( a->distance != b->distance ) {
+    return a->distance < b->distance ? -1 : 1;
+  }
+  return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static int
+qsort_neighbour_cmp( const void *a, const void *b ) {
+  return neighbour_cmp( a, b );
+}
+
+/* Offer hash j, which must come later in the list than any hash
+ * already offered, as a neighbour of hash i.
+ */
+static void
+add_neighbour( struct neighbour *nb, unsigned *used, unsigned knn,
+               unsigned j, unsigned distance ) {
+  struct neighbour e;
+  size_t i, child;
+
+  e.index = j;
+  e.distance = distance;
+
+  if ( *used < knn ) {
+    for ( i = ( *used )++; i > 0 && neighbour_cmp( &nb[( i - 1 ) / 2], &e ) < 0;
+          i = ( i - 1 ) / 2 ) {
+      nb[i] = nb[( i - 1 ) / 2];
+    }
+    nb[i] = e;
+    return;
+  }
+
+  if ( distance >= nb[0].distance ) {
+    return;
+  }
+  for ( i = 0; child = i * 2 + 1, child < knn; i = child ) {
+    if ( child + 1 < knn && neighbour_cmp( &nb[child + 1], &nb[child] ) > 0 ) {
+      child++;
+    }
+    if ( neighbour_cmp( &nb[child], &e ) <= 0 ) {
+      break;
+    }
+    nb[i] = nb[child];
+  }
+  nb[i] = e;
+}
+
+/* Find the knn nearest neighbours of hash i. Rows are independent, and
+ * so can be shared between threads, because each one scans the whole
+ * list rather than half of the pair triangle. With job->cross hash i is
+ * a query and only the reference hashes before job->from are scanned.
+ */
+static void
+knn_row( struct worker *w, size_t i ) {
+  const struct job *job = w->job;
+  const struct phash *data = job->data;
+  const unsigned char *bi = job_bits( job, i );
+  const unsigned char *si = job_summary( job, i );
+  struct neighbour *nb = job->neighbour + i * job->knn;
+  unsigned *used = &job->nneighbour[i];
+  unsigned limit, distance;
+  size_t j, k, n = 0, end = job->cross ? job->from : job->count;
+
+  if ( job->index ) {
+    n = index_candidates( w, i, 0 );
+  }
+  else {
+    w->n.examined += row_work( job, i );
+  }
+
+  for ( k = 0; job->index ? k < n : k < end; k++ ) {
+    j = job->index ? w->cand[k] : k;
+    if ( j == i || j >= end ) {
+      continue;
+    }
+    limit = *used < job->knn ? job->radius + 1
+        : MIN( nb[0].distance, job->radius + 1 );
+    distance = pair_distance( &w->n, bi, si, phash_bits( data, j ),
+                              phash_summary( data, j ), limit );
+    if ( distance < limit ) {
+      add_neighbour( nb, used, job->knn, j, distance );
+      w->n.inserted++;
+    }
+  }
+
+  qsort( nb, *used, sizeof( nb[0] ), qsort_neighbour_cmp );
+}
+
+/* Write every later pair at most job->radius apart */
+static void
+stream_row( struct worker *w, size_t i ) {
+  const struct job *job = w->job;
+  const unsigned char *bi = job_bits( job, i );
+  const unsigned char *si = job_summary( job, i );
+  const struct phash *cols;
+  size_t from = MAX( i + 1, job->from );
+  size_t j, k, base, n = 0;
+  struct correlation c;
+
+  if ( job->index ) {
+    n = index_candidates( w, i, from );
+  }
+  else {
+    w->n.examined += job->count - from;
+  }
+
+  cols = hash_set( job->data, job->query, from, &base );
+  c.pair[0] = i;
+  for ( k = 0; job->index ? k < n : from + k < job->count; k++ ) {
+    j = ( job->index ? w->cand[k] : from + k ) - base;
+    c.distance = pair_distance( &w->n, bi, si, phash_bits( cols, j ),
+                                phash_summary( cols, j ), job->radius + 1 );
+    if ( c.distance <= job->radius ) {
+      c.pair[1] = base + j;
+      write_pair( &w->out, job->data, job->query, &c );
+      w->n.found++;
+    }
+  }
+}
+
+static void
+show_neighbours( const struct job *job, int format ) {
+  struct writer out;
+  struct correlation c;
+  size_t i;
+  unsigned k;
+  init_writer( &out, stdout, format, NULL );
+  for ( i = 0; i < job->count; i++ ) {
+    const struct neighbour *nb = job->neighbour + i * job->knn;
+    c.pair[0] = i;
+    for ( k = 0; k < job->nneighbour[i]; k++ ) {
+      c.pair[1] = nb[k].index;
+      c.distance = nb[k].distance;
+      write_pair( &out, job->data, job->query, &c );
+    }
+  }
+  free_writer( &out );
+}
+
+static void
+correlate_row( struct worker *w, size_t i ) {
+  const struct job *job = w->job;
+  const unsigned char *bi = job_bits( job, i );
+  const unsigned char *si = job_summary( job, i );
+  const struct phash *cols;
+  struct top_k *top = &w->top;
+  unsigned distance;
+  size_t j, base, from = MAX( i + 1, job->from );
+  cols = hash_set( job->data, job->query, from, &base );
+  for ( j = from; j < job->count; j++ ) {
+    distance = pair_distance( &w->n, bi, si, phash_bits( cols, j - base ),
+                              phash_summary( cols, j - base ), top->cutoff );
+    if ( distance < top->cutoff ) {
+      insert_top_k( top, i, j, distance );
+      w->n.inserted++;
+    }
+  }
+  w->n.examined += row_work( job, i );
+}
+
+/* Compare the hash at rank a in popcount order with those above it. The
+ * popcounts of two hashes can differ by no more than their distance so
+ * once the gap reaches the limit the rest of the row can be skipped.
+ */
+static void
+sweep_row( struct worker *w, size_t a ) {
+  const struct job *job = w->job;
+  const struct phash *data = &job->sorted;
+  const unsigned char *bi = phash_bits( data, a );
+  const unsigned char *si = phash_summary( data, a );
+  struct top_k *top = &w->top;
+  unsigned limit, distance;
+  struct correlation c;
+  size_t b;
+
+  w->n.examined += data->count - 1 - a;
+  for ( b = a + 1; b < data->count; b++ ) {
+    limit = job->stream ? job->radius + 1 : top->cutoff;
+    if ( ( unsigned ) ( job->pop[b] - job->pop[a] ) >= limit ) {
+      w->n.swept += data->count - b;
+      w->n.examined -= data->count - b;
+      break;
+    }
+    distance = pair_distance( &w->n, bi, si, phash_bits( data, b ),
+                              phash_summary( data, b ), limit );
+    if ( distance >= limit ) {
+      continue;
+    }
+    c.pair[0] = MIN( job->order[a], job->order[b] );
+    c.pair[1] = MAX( job->order[a], job->order[b] );
+    c.distance = distance;
+    if ( job->stream ) {
+      write_pair( &w->out, job->data, job->query, &c );
+      w->n.found++;
+    }
+    else {
+      insert_top_k( top, c.pair[0], c.pair[1], c.distance );
+      w->n.inserted++;
+    }
+  }
+}
+
+static void
+scan_row( struct worker *w, size_t i ) {
+  if ( w->job->sweep ) {
+    sweep_row( w, i );
+  }
+  else if ( w->job->stream ) {
+    stream_row( w, i );
+  }
+  else if ( w->job->knn ) {
+    knn_row( w, i );
+  }
+  else if ( w->job->index ) {
+    index_row( w, i );
+  }
+  else {
+    correlate_row( w, i );
+  }
+}
+
+/* Compare a block of rows a tile of TILE_COLS hashes at a time, so that
+ * each tile is read from memory once for the whole block rather than
+ * once per row. Pairs don't arrive in list order.
+ */
+static void
+tile_rows( struct worker *w, size_t first, size_t rows ) {
+  const struct job *job = w->job;
+  const struct phash *cols;
+  struct top_k *top = &w->top;
+  size_t i, j, j0, j1, base, last = first + rows;
+  unsigned limit, distance;
+  struct correlation c;
+
+  j0 = MAX( first + 1, job->from );
+  cols = hash_set( job->data, job->query, j0, &base );
+  for ( ; j0 < job->count; j0 = j1 ) {
+    j1 = MIN( j0 + TILE_COLS, job->count );
+    for ( i = first; i < last && i + 1 < j1; i++ ) {
+      const unsigned char *bi = job_bits( job, i );
+      const unsigned char *si = job_summary( job, i );
+      for ( j = MAX( j0, i + 1 ); j < j1; j++ ) {
+        limit = job->stream ? job->radius + 1 : top->cutoff;
+        distance = pair_distance( &w->n, bi, si, phash_bits( cols, j - base ),
+                                  phash_summary( cols, j - base ), limit );
+        if ( distance >= limit ) {
+          continue;
+        }
+        c.pair[0] = i;
+        c.pair[1] = j;
+        c.distance = distance;
+        if ( job->stream ) {
+          write_pair( &w->out, job->data, job->query, &c );
+          w->n.found++;
+        }
+        else {
+          insert_top_k( top, i, j, distance );
+          w->n.inserted++;
+        }
+      }
+    }
+  }
+
+  for ( i = first; i < last; i++ ) {
+    w->n.examined += row_work( job, i );
+  }
+}
+
+static void
+scan_rows( struct worker *w, size_t first, size_t rows ) {
+  size_t n;
+  for ( ; rows; first += n, rows -= n ) {
+    if ( w->job->tiled ) {
+      n = MIN( rows, TILE_ROWS );
+      tile_rows( w, first, n );
+    }
+    else {
+      n = 1;
+      scan_row( w, first );
+    }
+  }
+}
+
+static void
+add_counts( struct counts *to, const struct counts *from ) {
+  unsigned i;
+  to->examined += from->examined;
+  to->swept += from->swept;
+  to->bounded += from->bounded;
+  to->evaluated += from->evaluated;
+  to->aborted += from->aborted;
+  to->segments += from->segments;
+  to->inserted += from->inserted;
+  to->busy += from->busy;
+  for ( i = 0; i <= MAX_HASH_LEN; i++ ) {
+    to->distances[i] += from->distances[i];
+  }
+  to->found += from->found;
+}
+
+/* A hash and its popcount, for sorting */
+struct rank {
+  unsigned pop, index;
+};
+
+static int
+rank_cmp( const void *a, const void *b ) {
+  const struct rank *ra = a, *rb = b;
+  if ( ra->pop != rb->pop ) {
+    return ra->pop < rb->pop ? -1 : 1;
+  }
+  return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+/* Make a copy of the hashes in popcount order for sweep_row() */
+static void
+init_sweep( struct job *job ) {
+  const struct phash *data = job->data;
+  struct rank *r = safe_malloc( sizeof( struct rank ) * MAX( data->count, 1 ) );
+  size_t i, k;
+
+  for ( i = 0; i < data->count; i++ ) {
+    const unsigned char *sum = phash_summary( data, i );
+    r[i].index = i;
+    for ( r[i].pop = 0, k = 0; k < SUMMARY_LEN; k++ ) {
+      r[i].pop += sum[k];
+    }
+  }
+  qsort( r, data->count, sizeof( r[0] ), rank_cmp );
+
+  init_phash( &job->sorted );
+  job->order = safe_malloc( sizeof( unsigned ) * MAX( data->count, 1 ) );
+  job->pop = safe_malloc( sizeof( unsigned short ) * MAX( data->count, 1 ) );
+  for ( i = 0; i < data->count; i++ ) {
+    add_phash( &job->sorted, phash_bits( data, r[i].index ) );
+    job->order[i] = r[i].index;
+    job->pop[i] = r[i].pop;
+  }
+  free( r );
+}
+
+/* Only scan rows start to end - 1 */
+static void
+set_rows( struct job *job, size_t start, size_t end ) {
+  size_t i;
+  job->start = MIN( start, job->count );
+  job->end = MIN( MAX( start, end ), job->count );
+  job->total = 0;
+  for ( i = job->start; i < job->end; i++ ) {
+    job->total += row_work( job, i );
+  }
+}
+
+/* Split the rows into shards of roughly equal work and only scan one of
+ * them. The split depends only on the list so every shard agrees on it.
+ */
+static void
+set_shard( struct job *job, unsigned shard, unsigned shards ) {
+  size_t i, count = job->count, start = count, end = count;
+  unsigned long lo, hi, done = 0;
+
+  set_rows( job, 0, count );
+  lo = job->total / shards * shard;
+  hi = shard + 1 < shards ? job->total / shards * ( shard + 1 ) : ULONG_MAX;
+  for ( i = 0; i < count; done += row_work( job, i ), i++ ) {
+    if ( start == count && done >= lo ) {
+      start = i;
+    }
+    if ( done >= hi ) {
+      end = i;
+      break;
+    }
+  }
+  set_rows( job, start, end );
+}
+
+static void
+init_job( struct job *job, const struct phash *data,
+          const struct phash *query, const struct mih *index,
+          unsigned radius, unsigned knn, size_t from, FILE * stream,
+          int spill, int sweep, int tiled ) {
+  pthread_mutex_init( &job->lock, NULL );
+  job->data = data;
+  job->query = query;
+  job->count = data->count + ( query ? query->count : 0 );
+  job->searched = job->count;
+  job->index = index;
+  job->radius = radius;
+  job->bound = radius < hash_len ? radius + 1 : UINT_MAX;
+  job->from = from;
+  job->cross = 0;
+  job->knn = knn;
+  job->stream = stream;
+  job->spill = spill;
+  job->format = OUT_HEX;
+  job->sweep = sweep;
+  job->tiled = tiled;
+  job->order = NULL;
+  job->pop = NULL;
+  init_phash( &job->sorted );
+  if ( sweep ) {
+    init_sweep( job );
+  }
+  job->neighbour = NULL;
+  job->nneighbour = NULL;
+  if ( knn ) {
+    job->neighbour = safe_malloc( sizeof( struct neighbour ) * knn
+                                  * MAX( job->count, 1 ) );
+    job->nneighbour = safe_malloc( sizeof( unsigned ) * MAX( job->count, 1 ) );
+    memset( job->nneighbour, 0, sizeof( unsigned ) * job->count );
+  }
+  job->chunk = NULL;
+  job->nchunks = job->next = 0;
+  job->done = 0;
+  set_rows( job, 0, job->count );
+  memset( &job->n, 0, sizeof( job->n ) );
+  job->thread = NULL;
+  job->lastpc = -1;
+  job->lastused = 0;
+}
+
+static void
+free_job( struct job *job ) {
+  free( job->chunk );
+  free( job->neighbour );
+  free( job->nneighbour );
+  free( job->order );
+  free( job->pop );
+  free_phash( &job->sorted );
+  pthread_mutex_destroy( &job->lock );
+}
+
+static void
+init_worker( struct worker *w, struct job *job, size_t nent ) {
+  size_t count = MAX( job->count, 1 );
+  w->job = job;
+  init_top_k( &w->top, nent );
+  w->top.ordered = !job->sweep && !job->tiled;
+  w->top.bound = job->bound;
+  w->top.cutoff = MIN( w->top.cutoff, job->bound );
+  memset( &w->n, 0, sizeof( w->n ) );
+  w->seen = w->cand = NULL;
+  w->out.buf = NULL;
+  if ( job->stream ) {
+    init_writer( &w->out, job->stream, job->spill ? OUT_BINARY : job->format,
+                 &job->lock );
+  }
+  if ( job->index ) {
+    w->seen = safe_malloc( sizeof( unsigned ) * count );
+    w->cand = safe_malloc( sizeof( unsigned ) * count );
+    memset( w->seen, 0, sizeof( unsigned ) * count );
+  }
+}
+
+static void
+free_worker( struct worker *w ) {
+  if ( w->out.buf ) {
+    free_writer( &w->out );
+  }
+  free( w->seen );
+  free( w->cand );
+}
+
+static void
+correlate( struct job *job, size_t nent, struct top_k *top ) {
+  struct worker w;
+  size_t i, r, n;
+  double start = now(  );
+
+  init_worker( &w, job, nent );
+
+  /* O(N^2) :) */
+  for ( i = job->start; i < job->end; i += n ) {
+    if ( verbose ) {
+      /* TODO is this called often enough? */
+      progress( job->done, job->total, w.top.used, nent, &job->lastpc,
+                &job->lastused );
+    }
+    n = job->tiled ? MIN( job->end - i, TILE_ROWS ) : 1;
+    scan_rows( &w, i, n );
+    for ( r = i; r < i + n; r++ ) {
+      job->done += row_work( job, r );
+    }
+  }
+  if ( verbose ) {
+    progress( job->done, job->total, w.top.used, nent, &job->lastpc,
+              &job->lastused );
+    fprintf( stderr, "\n" );
+  }
+
+  w.n.busy = now(  ) - start;
+  add_counts( &job->n, &w.n );
+  if ( job->thread ) {
+    add_counts( job->thread, &w.n );
+  }
+  free_worker( &w );
+  *top = w.top;
+}
+
+/* Split the rows of the pair triangle into at most want runs of roughly
+ * equal work.
+ */
+static struct chunk *
+make_chunks( const struct job *job, size_t want, size_t * nchunks ) {
+  struct chunk *ch = safe_malloc( sizeof( struct chunk ) * want );
+  unsigned long target = MAX( job->total / want, 1 );
+  size_t i, n = 0;
+
+  ch[0].first = job->start;
+  ch[0].rows = 0;
+  ch[0].work = 0;
+  for ( i = job->start; i < job->end; i++ ) {
+    if ( ch[n].work >= target && n + 1 < want ) {
+      n++;
+      ch[n].first = i;
+      ch[n].rows = 0;
+      ch[n].work = 0;
+    }
+    ch[n].rows++;
+    ch[n].work += row_work( job, i );
+  }
+
+  *nchunks = n + 1;
+  return ch;
+}
+
+static void *
+correlate_worker( void *arg ) {
+  struct worker *w = ( struct worker * ) arg;
+  struct job *job = w->job;
+  struct chunk *ch;
+  double start = now(  );
+
+  for ( ;; ) {
+    pthread_mutex_lock( &job->lock );
+    ch = job->next < job->nchunks ? &job->chunk[job->next++] : NULL;
+    if ( ch ) {
+      if ( verbose ) {
+        progress( job->done, job->total, w->top.used, w->top.keep,
+                  &job->lastpc, &job->lastused );
+      }
+      job->done += ch->work;
+    }
+    else {
+      w->n.busy = now(  ) - start;
+      add_counts( &job->n, &w->n );
+    }
+    pthread_mutex_unlock( &job->lock );
+
+    if ( !ch ) {
+      break;
+    }
+
+    scan_rows( w, ch->first, ch->rows );
+  }
+
+  return NULL;
+}
+
+/* Workers take chunks of rows in order so each sees its pairs in list
+ * order, which keeps the cutoff in each worker's top_k valid.
+ */
+static void
+correlate_threaded( struct job *job, size_t nent, unsigned threads,
+                    struct top_k *top ) {
+  struct worker *w = safe_malloc( sizeof( struct worker ) * threads );
+  unsigned i;
+  int rc;
+
+  job->chunk = make_chunks( job, threads * 16, &job->nchunks );
+
+  mention( "Splitting %lu pairs into %lu chunks for %u threads",
+           job->total, ( unsigned long ) job->nchunks, threads );
+
+  for ( i = 0; i < threads; i++ ) {
+    init_worker( &w[i], job, nent );
+    if ( rc = pthread_create( &w[i].thread, NULL, correlate_worker, &w[i] ),
+         rc ) {
+      die( "Can't create thread: %s", strerror( rc ) );
+    }
+  }
+
+  for ( i = 0; i < threads; i++ ) {
+    pthread_join( w[i].thread, NULL );
+    if ( job->thread ) {
+      add_counts( &job->thread[i], &w[i].n );
+    }
+    free_worker( &w[i] );
+  }
+
+  for ( i = 1; i < threads; i++ ) {
+    merge_top_k( &w[0].top, &w[i].top );
+  }
+
+  if ( verbose ) {
+    progress( job->total, job->total, w[0].top.used, nent, &job->lastpc,
+              &job->lastused );
+    fprintf( stderr, "\n" );
+  }
+
+  *top = w[0].top;
+  free( w );
+}
+
+/* Compare the hashes in data with each other, or only the first from
+ * of them with the rest if from isn't 0, and add the pairs found to tk.
+ * Hashes before from are base0 on in the list, the rest base1 on.
+ */
+static void
+correlate_block( const struct phash *data, size_t from, size_t nent,
+                 unsigned threads, int tiled, struct top_k *tk,
+                 struct counts *n, struct counts *thread, size_t base0,
+                 size_t base1 ) {
+  struct job job;
+  struct top_k found;
+  struct correlation *c;
+  size_t i, j;
+
+  init_job( &job, data, NULL, NULL, hash_len, 0, from, NULL, 0, 0, tiled );
+  job.bound = tk->cutoff;
+  job.thread = thread;
+  if ( from ) {
+    job.cross = 1;
+    set_rows( &job, 0, from );
+  }
+  if ( threads > 1 ) {
+    correlate_threaded( &job, nent, threads, &found );
+  }
+  else {
+    correlate( &job, nent, &found );
+  }
+  add_counts( n, &job.n );
+
+  for ( i = 0; i < found.used + found.nties; i++ ) {
+    c = i < found.used ? &found.heap[i] : &found.ties[i - found.used];
+    for ( j = 0; j < 2; j++ ) {
+      c->pair[j] += from && c->pair[j] >= from ? base1 - from : base0;
+    }
+    insert_top_k( tk, c->pair[0], c->pair[1], c->distance );
+  }
+  free_top_k( &found );
+  free_job( &job );
+}
+
+/* Compare every pair of the binary dump in fd holding no more than rows
+ * hashes in memory at once: a block of them, the block they're being
+ * compared with and the next block, which is read while the others are
+ * compared. Each block is compared with itself and then with each later
+ * block in turn.
+ */
+static void
+correlate_blocks( int fd, const struct dump_header *hdr, size_t rows,
+                  size_t nent, unsigned threads, int tiled,
+                  struct top_k *tk, struct counts *n, struct counts *thread,
+                  unsigned long *total ) {
+  struct phash pair;            /* a block followed by the block it meets */
+  struct block next;
+  size_t count = hdr->count, blocks = ( count + rows - 1 ) / rows;
+  size_t a, b, n0 = 0, nb, step, steps = blocks * ( blocks + 1 ) / 2;
+  unsigned long done = 0;
+  unsigned lastpc = -1;
+  size_t lastused = 0;
+  int was = verbose;
+  int rc;
+
+  init_top_k( tk, nent );
+  tk->ordered = 0;
+  *total = count * ( count - 1.0 ) / 2;
+  mention( "Comparing %lu hashes in %lu blocks of %lu, %lu block reads",
+           ( unsigned long ) count, ( unsigned long ) blocks,
+           ( unsigned long ) rows, ( unsigned long ) steps );
+
+  pair.bits = safe_aligned_malloc( rows * 2 * hash_bytes );
+  pair.summary = safe_aligned_malloc( rows * 2 * SUMMARY_LEN );
+  pair.size = rows * 2;
+  pair.map = NULL;
+  next.fd = fd;
+  next.hdr = hdr;
+  next.bits = safe_aligned_malloc( rows * hash_bytes );
+  next.summary = safe_aligned_malloc( rows * SUMMARY_LEN );
+
+  /* Step a, b compares block a with block b */
+  for ( step = 0, a = 0, b = 0; step < steps; step++ ) {
+    if ( step == 0 ) {
+      next.first = 0;
+      next.count = MIN( rows, count );
+      read_block( &next );
+    }
+    else if ( rc = pthread_join( next.thread, NULL ), rc ) {
+      die( "Can't join thread: %s", strerror( rc ) );
+    }
+    nb = next.count;
+    if ( a == b ) {
+      n0 = nb;
+    }
+    memcpy( pair.bits + ( a == b ? 0 : n0 ) * hash_bytes, next.bits,
+            nb * hash_bytes );
+    memcpy( pair.summary + ( a == b ? 0 : n0 ) * SUMMARY_LEN, next.summary,
+            nb * SUMMARY_LEN );
+
+    /* Read the block for the next step while this one is compared */
+    if ( step + 1 < steps ) {
+      size_t c = b + 1 < blocks ? b + 1 : a + 1;
+      next.first = c * rows;
+      next.count = MIN( rows, count - next.first );
+      if ( rc = pthread_create( &next.thread, NULL, read_block, &next ),
+           rc ) {
+        die( "Can't create thread: %s", strerror( rc ) );
+      }
+    }
+
+    if ( was ) {
+      progress( done, *total, tk->used, nent, &lastpc, &lastused );
+    }
+    verbose = 0;
+    pair.count = a == b ? n0 : n0 + nb;
+    correlate_block( &pair, a == b ? 0 : n0, nent, threads, tiled, tk, n,
+                     thread, a * rows, b * rows );
+    verbose = was;
+    done += a == b ? n0 * ( n0 - 1.0 ) / 2 : ( double ) n0 * nb;
+
+    if ( ++b == blocks ) {
+      b = ++a;
+    }
+  }
+  if ( was ) {
+    progress( done, *total, tk->used, nent, &lastpc, &lastused );
+    fprintf( stderr, "\n" );
+  }
+
+  free_phash( &pair );
+  free( next.bits );
+  free( next.summary );
+}
+
+/* Read just the hashes of the pairs in c from the dump in fd into ph and
+ * point the pairs at them.
+ */
+static void
+read_pairs( int fd, const struct dump_header *hdr, struct correlation *c,
+            size_t nused, struct phash *ph ) {
+  unsigned char hash[MAX_HASH_BYTES];
+  size_t i, j;
+  for ( i = 0; i < nused; i++ ) {
+    for ( j = 0; j < 2; j++ ) {
+      read_at( fd, hash, hash_bytes,
+               hdr->bits_offset + ( off_t ) c[i].pair[j] * hash_bytes );
+      c[i].pair[j] = ph->count;
+      add_phash( ph, hash );
+    }
+  }
+}
+
+static void
+init_groups( struct groups *g, size_t count ) {
+  size_t i;
+  g->count = count;
+  g->parent = safe_malloc( sizeof( unsigned ) * MAX( count, 1 ) );
+  g->size = safe_malloc( sizeof( unsigned ) * MAX( count, 1 ) );
+  g->degree = safe_malloc( sizeof( unsigned ) * MAX( count, 1 ) );
+  for ( i = 0; i < count; i++ ) {
+    g->parent[i] = i;
+    g->size[i] = 1;
+    g->degree[i] = 0;
+  }
+}
+
+static void
+free_groups( struct groups *g ) {
+  free( g->parent );
+  free( g->size );
+  free( g->degree );
+}
+
+static unsigned
+find_group( struct groups *g, unsigned i ) {
+  while ( g->parent[i] != i ) {
+    i = g->parent[i] = g->parent[g->parent[i]];
+  }
+  return i;
+}
+
+static void
+join_group( struct groups *g, unsigned a, unsigned b ) {
+  g->degree[a]++;
+  g->degree[b]++;
+  a = find_group( g, a );
+  b = find_group( g, b );
+  if ( a == b ) {
+    return;
+  }
+  if ( g->size[a] < g->size[b] ) {
+    unsigned t = a;
+    a = b;
+    b = t;
+  }
+  g->parent[b] = a;
+  g->size[a] += g->size[b];
+}
+
+/* Join the hashes of the count pairs spilled to fl */
+static void
+read_groups( FILE * fl, uint64_t count, struct groups *g ) {
+  struct correlation *mem = new_correlation( SORT_RUN );
+  uint64_t seen = 0;
+  size_t len, i;
+
+  rewind( fl );
+  while ( len = fread( mem, sizeof( mem[0] ), SORT_RUN, fl ), len ) {
+    for ( i = 0; i < len; i++ ) {
+      join_group( g, mem[i].pair[0], mem[i].pair[1] );
+    }
+    seen += len;
+  }
+  if ( seen != count ) {
+    die( "Read %lu pairs back, expected %lu", ( unsigned long ) seen,
+         ( unsigned long ) count );
+  }
+  free_correlation( mem );
+}
+
+static void
+write_group( struct writer *wr, const struct phash *data,
+             const struct phash *query, const unsigned *member, size_t n ) {
+  static const char hex[] = "0123456789abcdef";
+  size_t len = wr->format == OUT_INDEX ? 11 + 1 : hash_chars + 1;
+  const unsigned char *h;
+  size_t k;
+  unsigned i;
+  char *p;
+
+  for ( k = 0; k < n; k++ ) {
+    if ( wr->used + len > WRITER_BUF ) {
+      flush_writer( wr );
+    }
+    p = wr->buf + wr->used;
+    if ( k ) {
+      *p++ = ' ';
+    }
+    if ( wr->format == OUT_INDEX ) {
+      p = put_number( p, member[k], 0 );
+    }
+    else {
+      h = list_bits( data, query, member[k] );
+      for ( i = 0; i < hash_bytes; i++ ) {
+        *p++ = hex[h[i] >> 4];
+        *p++ = hex[h[i] & 15];
+      }
+    }
+    wr->used = p - wr->buf;
+  }
+  if ( wr->used + 1 > WRITER_BUF ) {
+    flush_writer( wr );
+  }
+  wr->buf[wr->used++] = '\n';
+}
+
+/* Split the n hashes of a group, in list order, into groups that are all
+ * within radius of their first hash. The hash in the most pairs leads
+ * each group, then everything close enough to it joins it. Returns the
+ * number of groups of more than one hash written.
+ */
+static size_t
+split_group( struct writer *wr, const struct phash *data,
+             const struct phash *query, const struct groups *g,
+             unsigned *member, size_t n, unsigned *scratch,
+             unsigned radius ) {
+  size_t written = 0, i, best, kept, left;
+  const unsigned char *lead;
+
+  while ( n > 1 ) {
+    for ( best = 0, i = 1; i < n; i++ ) {
+      if ( g->degree[member[i]] > g->degree[member[best]] ) {
+        best = i;
+      }
+    }
+    lead = list_bits( data, query, member[best] );
+    scratch[0] = member[best];
+    for ( kept = 1, left = 0, i = 0; i < n; i++ ) {
+      if ( i == best ) {
+        continue;
+      }
+      if ( distance_kernel( lead, list_bits( data, query, member[i] ) )
+           <= radius ) {
+        scratch[kept++] = member[i];
+      }
+      else {
+        member[left++] = member[i];
+      }
+    }
+    if ( kept > 1 ) {
+      write_group( wr, data, query, scratch, kept );
+      written++;
+    }
+    n = left;
+  }
+  return written;
+}
+
+/* Write every group of more than one hash, one to a line, in the order of
+ * their first hash. Returns the number of groups written.
+ */
+static size_t
+show_groups( struct groups *g, const struct phash *data,
+             const struct phash *query, unsigned radius, int format ) {
+  unsigned *first = safe_malloc( sizeof( unsigned ) * ( g->count + 1 ) );
+  unsigned *member = safe_malloc( sizeof( unsigned ) * MAX( g->count, 1 ) );
+  unsigned *scratch = safe_malloc( sizeof( unsigned ) * MAX( g->count, 1 ) );
+  unsigned *label = safe_malloc( sizeof( unsigned ) * MAX( g->count, 1 ) );
+  unsigned *group = scratch;    /* the group of each hash, until split */
+  size_t groups = 0, written = 0, i, r, n;
+  struct writer out;
+
+  /* Number the groups in order of their first hash */
+  memset( label, 0xff, sizeof( unsigned ) * g->count );
+  for ( i = 0; i < g->count; i++ ) {
+    r = find_group( g, i );
+    if ( label[r] == UINT_MAX ) {
+      label[r] = groups++;
+    }
+    group[i] = label[r];
+  }
+  free( label );
+
+  /* Then list the hashes of each group in list order */
+  memset( first, 0, sizeof( unsigned ) * ( groups + 1 ) );
+  for ( i = 0; i < g->count; i++ ) {
+    first[group[i] + 1]++;
+  }
+  for ( i = 0; i < groups; i++ ) {
+    first[i + 1] += first[i];
+  }
+  for ( i = 0; i < g->count; i++ ) {
+    member[first[group[i]]++] = i;
+  }
+  for ( i = groups; i > 0; i-- ) {
+    first[i] = first[i - 1];
+  }
+  first[0] = 0;
+
+  init_writer( &out, stdout, format, NULL );
+  for ( i = 0; i < groups; i++ ) {
+    n = first[i + 1] - first[i];
+    if ( n < 2 ) {
+      continue;
+    }
+    if ( radius == UINT_MAX ) {
+      write_group( &out, data, query, member + first[i], n );
+      written++;
+    }
+    else {
+      written += split_group( &out, data, query, g, member + first[i], n,
+                              scratch, radius );
+    }
+  }
+  free_writer( &out );
+
+  free( first );
+  free( member );
+  free( scratch );
+  return written;
+}
+
+/* Merge the saved pairs of every shard of a search into tk */
+static void
+merge_shards( const char **name, unsigned n, struct top_k *tk,
+              const struct phash *data, unsigned radius ) {
+  struct state_header hdr;
+  unsigned char *seen = NULL;
+  unsigned i, shards = 0;
+
+  for ( i = 0; i < n; i++ ) {
+    mention( "Merging pairs from %s", name[i] );
+    load_top_k( name[i], tk, data, data->count, radius, &hdr );
+    if ( !seen ) {
+      shards = hdr.shards;
+      seen = safe_malloc( shards );
+      memset( seen, 0, shards );
+    }
+    if ( hdr.shards != shards ) {
+      die( "%s is one of %u shards, not %u", name[i],
+           ( unsigned ) hdr.shards, shards );
+    }
+    if ( seen[hdr.shard]++ ) {
+      die( "%s repeats shard %u/%u", name[i], ( unsigned ) hdr.shard,
+           shards );
+    }
+  }
+
+  for ( i = 0; i < shards; i++ ) {
+    if ( !seen[i] ) {
+      die( "Shard %u/%u is missing", i, shards );
+    }
+  }
+  free( seen );
+}
+
+enum { STAGE_LOAD, STAGE_PREPARE, STAGE_SEARCH, STAGE_FINISH, STAGE_OUTPUT,
+  STAGES
+};
+
+static const char *stage_name[STAGES] = {
+  "load", "prepare", "search", "finish", "output"
+};
+
+static void
+write_counts( FILE * fl, const struct counts *n, const char *indent ) {
+  fprintf( fl, "%s\"examined\": %lu,\n", indent, n->examined );
+  fprintf( fl, "%s\"swept\": %lu,\n", indent, n->swept );
+  fprintf( fl, "%s\"bounded\": %lu,\n", indent, n->bounded );
+  fprintf( fl, "%s\"evaluated\": %lu,\n", indent, n->evaluated );
+  fprintf( fl, "%s\"aborted\": %lu,\n", indent, n->aborted );
+  fprintf( fl, "%s\"inserted\": %lu,\n", indent, n->inserted );
+  fprintf( fl, "%s\"found\": %lu,\n", indent, n->found );
+  fprintf( fl, "%s\"busy\": %.6f", indent, n->busy );
+}
+
+/* Write what the search did to name as JSON: the time taken by each
+ * stage, what happened to the pairs, the distances computed and the
+ * share of each thread.
+ */
+static void
+write_stats( const char *name, const struct job *job, size_t hashes,
+             size_t keep, unsigned threads, const char *kernel,
+             const double *stage ) {
+  FILE *fl = fopen( name, "w" );
+  struct rusage ru;
+  double total = 0;
+  unsigned i;
+
+  if ( !fl ) {
+    die( "Can't write %s: %s", name, strerror( errno ) );
+  }
+  getrusage( RUSAGE_SELF, &ru );
+
+  fprintf( fl, "{\n  \"hashes\": %lu,\n  \"searched\": %lu,\n",
+           ( unsigned long ) hashes, ( unsigned long ) job->searched );
+  fprintf( fl, "  \"hash_len\": %u,\n  \"keep\": %lu,\n", hash_len,
+           ( unsigned long ) keep );
+  fprintf( fl, "  \"threads\": %u,\n  \"kernel\": \"%s\",\n", threads,
+           kernel );
+  fprintf( fl, "  \"early_abort\": %s,\n",
+           bounded_kernel ? "true" : "false" );
+
+  fprintf( fl, "  \"seconds\": {\n" );
+  for ( i = 0; i < STAGES; i++ ) {
+    fprintf( fl, "    \"%s\": %.6f,\n", stage_name[i], stage[i] );
+    total += stage[i];
+  }
+  fprintf( fl, "    \"total\": %.6f\n  },\n", total );
+
+  fprintf( fl, "  \"pairs\": {\n    \"total\": %lu,\n", job->total );
+  write_counts( fl, &job->n, "    " );
+  fprintf( fl, "\n  },\n" );
+  fprintf( fl, "  \"pairs_per_second\": %.0f,\n",
+           stage[STAGE_SEARCH] > 0 ? job->n.examined / stage[STAGE_SEARCH]
+           : 0 );
+  fprintf( fl, "  \"peak_rss_kb\": %ld,\n", ( long ) ru.ru_maxrss );
+
+  fprintf( fl, "  \"distances\": [" );
+  for ( i = 0; i <= hash_len; i++ ) {
+    fprintf( fl, "%s%s%lu", i ? "," : "", i % 16 ? " " : "\n    ",
+             job->n.distances[i] );
+  }
+  fprintf( fl, "\n  ],\n" );
+
+  fprintf( fl, "  \"per_thread\": [" );
+  for ( i = 0; job->thread && i < threads; i++ ) {
+    fprintf( fl, "%s\n    {\n", i ? "," : "" );
+    write_counts( fl, &job->thread[i], "      " );
+    fprintf( fl, "\n    }" );
+  }
+  fprintf( fl, "\n  ]\n}\n" );
+
+  if ( fclose( fl ) ) {
+    die( "Can't write %s: %s", name, strerror( errno ) );
+  }
+}
+
+static unsigned long
+parse_number( const char *s ) {
+  char *ep;
+  unsigned long n = strtoul( s, &ep, 10 );
+  if ( *ep || ep == s ) {
+    die( "Bad number" );
+  }
+  return n;
+}
+
+static void
+usage( void ) {
+  fprintf( stderr, "Usage: " PROG " [options] < dump\n\n"
+           "The dump may be text, one hex hash per line, or binary as\n"
+           "written by --binary.\n\n"
+           "Options:\n"
+           "  -K, --keep    <N> Number of matches to keep (default 1000)\n"
+           "  -t, --threads <N> Number of threads to search with (default 1)\n"
+           "  -k, --kernel  <K> Distance kernel to use (default: fastest\n"
+           "                    supported), --kernel list to list them\n"
+           "      --early-abort Compute distances a segment at a time and give\n"
+           "                    up once a pair is too far apart to be kept;\n"
+           "                    only the popcnt, scalar and table kernels can,\n"
+           "                    and it's rarely faster\n"
+           "  -r, --radius  <R> Only look for pairs at most R apart using a\n"
+           "                    multi-index hash to find candidates\n"
+           "  -p, --parts   <P> Substrings per hash in the index, at least one\n"
+           "                    per 64 bits (default: cheapest with substrings\n"
+           "                    of 16 bits or more, or no index if none would\n"
+           "                    beat comparing every pair)\n"
+           "  -m, --max-distance <D> Write every pair at most D apart as it's\n"
+           "                    found instead of keeping the closest pairs\n"
+           "  -S, --sort        With --max-distance, sort the pairs into the\n"
+           "                    usual order before writing them\n"
+           "  -g, --groups  <D> Write groups of hashes joined by pairs at most\n"
+           "                    D apart, one group to a line, instead of pairs\n"
+           "      --group-radius <R> Split groups so every hash is at most R\n"
+           "                    from the first hash of its group\n"
+           "  -w, --sweep       Compare hashes in popcount order, which lets\n"
+           "                    runs of pairs too far apart be skipped\n"
+           "  -T, --no-tile     Compare one row at a time rather than in blocks\n"
+           "                    of hashes that fit in cache\n"
+           "      --rows    <N> Only compare the first N hashes with the rest\n"
+           "                    of the list, for benchmarks\n"
+           "      --no-dedup    Compare every copy of a hash that appears more\n"
+           "                    than once rather than one of them\n"
+           "  -n, --knn     <N> List the N nearest neighbours of every hash\n"
+           "                    instead of the closest pairs overall\n"
+           "  -d, --delta   <F> Add the hashes in F to the end of the list and\n"
+           "                    only compare pairs that involve them\n"
+           "  -P, --previous <F> Merge in the pairs saved by --save from a run\n"
+           "                    over the list before --delta was added\n"
+           "  -q, --query   <F> Only compare the hashes in F with those in the\n"
+           "                    dump, not with each other; with --knn list\n"
+           "                    neighbours of the hashes in F only\n"
+           "  -s, --save    <F> Save the pairs found to F for --previous or\n"
+           "                    --merge\n"
+           "  -x, --shard <I/N> Only search shard I of N, numbered from 0,\n"
+           "                    and --save the pairs found rather than\n"
+           "                    writing them\n"
+           "  -M, --merge   <F> Don't search, just merge the pairs saved by\n"
+           "                    every shard of a search; repeat for each shard\n"
+           "  -B, --budget <MB> Read the hashes from a binary dump a block at\n"
+           "                    a time, using at most MB megabytes for them\n"
+           "  -o, --output  <F> Write pairs as hex hashes (the default), as\n"
+           "                    index to give the position of each hash in the\n"
+           "                    dump --binary would write instead, or as binary\n"
+           "                    records of two 32 bit indexes and the distance\n"
+           "  -b, --binary  <F> Write the hashes, including any --delta, to F\n"
+           "                    as a binary dump and exit\n"
+           "      --stats   <F> Write the time taken, what happened to each\n"
+           "                    pair and the distances computed to F as JSON\n"
+           "  -v, --verbose     Verbose output\n"
+           "  -h, --help        See this text\n\n"
+           "Hashes may be 256, 512, 768 or 1024 bits long, as long as they're\n"
+           "all the same length.\n" );
+  exit( 1 );
+}
+
+int
+main( int argc, char *argv[] ) {
+  struct phash data, queries;   /* queries stay apart from the dump */
+  struct correlation *c;
+  struct top_k top;
+  size_t nent = 1000, nused, from = 0;
+  unsigned threads = 1;
+  const char *kernel = NULL;
+  const char *binary = NULL;
+  const char *delta = NULL, *previous = NULL, *save = NULL;
+  const char *query = NULL, *stats = NULL, *kernel_name;
+  const char **merge = safe_malloc( sizeof( char * ) * argc );
+  unsigned nmerge = 0, shard = 0, shards = 1;
+  unsigned long radius = ULONG_MAX, parts = 0, knn = 0;
+  unsigned long max_distance = ULONG_MAX;
+  unsigned long groups = ULONG_MAX, group_radius = ULONG_MAX;
+  int format = OUT_HEX;
+  int sort = 0, sweep = 0, tiled = 1, dedup = 1, early = 0;
+  unsigned long rows = ULONG_MAX, budget = 0;
+  struct dump_header hdr;
+  int fd = -1;
+  FILE *stream = NULL;
+  struct mih *index = NULL;
+  struct job job;
+  struct dedup dd;
+  const struct phash *search = &data;
+  double start, elapsed, mark, stage[STAGES] = { 0 };
+  int ch;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"keep", required_argument, NULL, 'K'},
+    {"threads", required_argument, NULL, 't'},
+    {"kernel", required_argument, NULL, 'k'},
+    {"radius", required_argument, NULL, 'r'},
+    {"parts", required_argument, NULL, 'p'},
+    {"max-distance", required_argument, NULL, 'm'},
+    {"sort", no_argument, NULL, 'S'},
+    {"groups", required_argument, NULL, 'g'},
+    {"group-radius", required_argument, NULL, 'G'},
+    {"sweep", no_argument, NULL, 'w'},
+    {"no-tile", no_argument, NULL, 'T'},
+    {"rows", required_argument, NULL, 'R'},
+    {"no-dedup", no_argument, NULL, 'D'},
+    {"budget", required_argument, NULL, 'B'},
+    {"early-abort", no_argument, NULL, 'E'},
+    {"knn", required_argument, NULL, 'n'},
+    {"delta", required_argument, NULL, 'd'},
+    {"previous", required_argument, NULL, 'P'},
+    {"query", required_argument, NULL, 'q'},
+    {"save", required_argument, NULL, 's'},
+    {"shard", required_argument, NULL, 'x'},
+    {"merge", required_argument, NULL, 'M'},
+    {"output", required_argument, NULL, 'o'},
+    {"binary", required_argument, NULL, 'b'},
+    {"stats", required_argument, NULL, 'J'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ( ch = getopt_long( argc, argv, "hvK:t:k:r:p:m:Sg:wTn:d:P:q:s:x:M:o:b:B:", opts, NULL ), ch != -1 ) {
+    switch ( ch ) {
+    case 'v':
+      verbose++;
+      break;
+    case 'K':
+      {
+        char *ep;
+        nent = strtod( optarg, &ep );
+        if ( *ep ) {
+          die( "Bad number" );
+        }
       }
       break;
+    case 't':
+      if ( threads = parse_number( optarg ), threads < 1 ) {
+        die( "Bad number" );
+      }
+      break;
+    case 'r':
+      radius = parse_number( optarg );
+      break;
+    case 'p':
+      parts = parse_number( optarg );
+      break;
+    case 'm':
+      max_distance = parse_number( optarg );
+      break;
+    case 'S':
+      sort++;
+      break;
+    case 'g':
+      groups = parse_number( optarg );
+      break;
+    case 'G':
+      group_radius = parse_number( optarg );
+      break;
+    case 'w':
+      sweep++;
+      break;
+    case 'T':
+      tiled = 0;
+      break;
+    case 'R':
+      rows = parse_number( optarg );
+      break;
+    case 'D':
+      dedup = 0;
+      break;
+    case 'E':
+      early = 1;
+      break;
+    case 'B':
+      if ( budget = parse_number( optarg ), budget < 1 ) {
+        die( "Bad number" );
+      }
+      break;
+    case 'n':
+      if ( knn = parse_number( optarg ), knn < 1 || knn > UINT_MAX ) {
+        die( "Bad number" );
+      }
+      break;
+    case 'k':
+      if ( !strcmp( optarg, "list" ) ) {
+        list_kernels(  );
+        return 0;
+      }
+      kernel = optarg;
+      break;
+    case 'd':
+      delta = optarg;
+      break;
+    case 'P':
+      previous = optarg;
+      break;
+    case 'q':
+      query = optarg;
+      break;
+    case 's':
+      save = optarg;
+      break;
+    case 'x':
+      {
+        int len = 0;
+        if ( sscanf( optarg, "%u/%u%n", &shard, &shards, &len ) != 2
+             || optarg[len] || shard >= shards ) {
+          die( "Bad shard, expected I/N with I < N" );
+        }
+      }
+      break;
+    case 'M':
+      merge[nmerge++] = optarg;
+      break;
+    case 'o':
+      if ( !strcmp( optarg, "hex" ) ) {
+        format = OUT_HEX;
+      }
+      else if ( !strcmp( optarg, "index" ) ) {
+        format = OUT_INDEX;
+      }
+      else if ( !strcmp( optarg, "binary" ) ) {
+        format = OUT_BINARY;
+      }
+      else {
+        die( "Unknown output format %s", optarg );
+      }
+      break;
+    case 'b':
+      binary = optarg;
+      break;
+    case 'J':
+      stats = optarg;
+      break;
     case 'h':
     default:
       usage(  );
@@ -393,30 +3446,383 @@ main( int argc, char *argv[] ) {
     usage(  );
     return 0;                   /* not reached, silence warning */
   }
-  else if ( argc > 0 ) {
+
+  init_phash( &data );
+  init_phash( &queries );
+  start = mark = now(  );
+
+  if ( argc > 0 ) {
     FILE *fl = fopen( argv[0], "r" );
     if ( !fl ) {
       die( "Can't read %s", argv[0] );
     }
     mention( "Reading %s", argv[0] );
-    data = read_file( fl, &count );
+    if ( budget ) {
+      fd = dup( fileno( fl ) );
+      read_dump_header( fd, &hdr );
+    }
+    else {
+      read_file( fl, &data );
+    }
     fclose( fl );
   }
+  else if ( budget ) {
+    die( "--budget needs a binary dump file, write one with --binary" );
+  }
   else {
-    data = read_file( stdin, &count );
+    read_file( stdin, &data );
+  }
+  mention( "Loaded %lu hashes in %.2fs",
+           ( unsigned long ) ( budget ? hdr.count : data.count ),
+           now(  ) - start );
+
+  if ( query && ( delta || previous || save || nmerge || shards > 1
+                 || sweep || binary ) ) {
+    die( "--query can't be used with --delta, --previous, --save, "
+         "--merge, --shard, --sweep or --binary" );
+  }
+  if ( knn && ( delta || previous || save ) ) {
+    die( "--knn can't be used with --delta, --previous or --save" );
+  }
+  if ( max_distance != ULONG_MAX && ( knn || previous || save ) ) {
+    die( "--max-distance can't be used with --knn, --previous or --save" );
+  }
+  if ( sweep && ( knn || delta || radius != ULONG_MAX ) ) {
+    die( "--sweep can't be used with --knn, --delta or --radius" );
+  }
+  /* The other searches don't visit the whole triangle */
+  if ( knn || sweep || radius != ULONG_MAX ) {
+    tiled = 0;
+  }
+  if ( ( shards > 1 || nmerge )
+       && ( knn || delta || previous || max_distance != ULONG_MAX ) ) {
+    die( "--shard and --merge can't be used with --knn, --delta, "
+         "--previous or --max-distance" );
+  }
+  if ( shards > 1 && !save ) {
+    die( "--shard needs --save" );
+  }
+  if ( sort && max_distance == ULONG_MAX ) {
+    die( "--sort needs --max-distance" );
+  }
+  if ( group_radius != ULONG_MAX && groups == ULONG_MAX ) {
+    die( "--group-radius needs --groups" );
+  }
+  /* Groups are built from every pair at most groups apart, spilled to a
+   * temporary file as they're found
+   */
+  if ( groups != ULONG_MAX ) {
+    if ( knn || max_distance != ULONG_MAX || previous || save || nmerge
+         || shards > 1 || budget || format == OUT_BINARY ) {
+      die( "--groups can't be used with --knn, --max-distance, --previous, "
+           "--save, --shard, --merge, --budget or --output binary" );
+    }
+    max_distance = groups;
+  }
+  if ( budget && ( knn || max_distance != ULONG_MAX || radius != ULONG_MAX
+                   || sweep || delta || previous || query || save || nmerge
+                   || shards > 1 || rows != ULONG_MAX || binary ) ) {
+    die( "--budget can only be used to find the closest pairs" );
+  }
+  /* Only the closest pairs of a whole list can be rebuilt from those of
+   * its unique hashes
+   */
+  if ( knn || delta || previous || query || nmerge || shards > 1
+       || max_distance != ULONG_MAX || rows != ULONG_MAX || budget ) {
+    dedup = 0;
+  }
+
+  /* Pairs within the list we already have are in the previous state, or
+   * with --query aren't wanted
+   */
+  if ( delta || previous || query ) {
+    from = data.count;
+  }
+
+  /* The queries get an arena of their own so a mapped dump stays mapped */
+  if ( query ) {
+    FILE *fl = fopen( query, "r" );
+    if ( !fl ) {
+      die( "Can't read %s", query );
+    }
+    start = now(  );
+    read_file( fl, &queries );
+    fclose( fl );
+    mention( "Read %lu queries from %s in %.2fs",
+             ( unsigned long ) queries.count, query, now(  ) - start );
   }
 
-  mention( "Looking for %lu correlations in %lu files",
-           ( unsigned long ) nent, ( unsigned long ) count );
+  if ( delta ) {
+    struct phash more;
+    FILE *fl = fopen( delta, "r" );
+    if ( !fl ) {
+      die( "Can't read %s", delta );
+    }
+    start = now(  );
+    init_phash( &more );
+    read_file( fl, &more );
+    fclose( fl );
+    append_phash( &data, &more );
+    free_phash( &more );
+    mention( "Added %lu hashes from %s in %.2fs",
+             ( unsigned long ) ( data.count - from ), delta, now(  ) - start );
+  }
+
+  stage[STAGE_LOAD] = now(  ) - mark;
+  mark = now(  );
+
+  /* Nothing was read to say otherwise */
+  if ( !hash_len ) {
+    set_hash_len( DEFAULT_HASH_LEN );
+  }
+
+  if ( binary ) {
+    mention( "Writing %lu hashes to %s", ( unsigned long ) data.count,
+             binary );
+    write_binary( binary, &data );
+    free_phash( &data );
+    return 0;
+  }
+
+  if ( knn ) {
+    mention( "Looking for %lu neighbours of %lu files", knn,
+             ( unsigned long ) ( data.count + queries.count ) );
+    nent = 0;
+  }
+  else if ( max_distance != ULONG_MAX ) {
+    mention( "Looking for pairs at most %lu apart in %lu files",
+             max_distance, ( unsigned long ) ( data.count + queries.count ) );
+    nent = 0;
+    stream = sort || groups != ULONG_MAX ? tmpfile(  ) : stdout;
+    if ( !stream ) {
+      die( "Can't create temporary file: %s", strerror( errno ) );
+    }
+  }
+  else {
+    mention( "Looking for %lu correlations in %lu files",
+             ( unsigned long ) nent,
+             ( unsigned long ) ( budget ? hdr.count
+                                 : data.count + queries.count ) );
+  }
 
 #ifdef DEBUG
-  dump_phash( data );
+  dump_phash( &data );
 #endif
 
-  c = correlate( data, nent, &nused );
-  show_correlation( c, nused );
+  if ( dedup ) {
+    start = now(  );
+    if ( dedup = find_copies( &dd, &data ), dedup ) {
+      search = &dd.unique;
+    }
+    mention( "Collapsed %lu hashes to %lu unique in %.2fs, %lu of them "
+             "with %lu copies", ( unsigned long ) data.count,
+             ( unsigned long ) search->count, now(  ) - start,
+             ( unsigned long ) dd.groups, ( unsigned long ) dd.copies );
+    if ( !dedup ) {
+      free_dedup( &dd );
+    }
+  }
+
+  kernel_name = setup_kernel( kernel, early );
+
+  if ( radius != ULONG_MAX ) {
+    const struct phash *filed = search;
+    size_t base = 0;
+    double row;
+
+    if ( radius >= hash_len ) {
+      die( "Radius must be less than %u", hash_len );
+    }
+    if ( parts && ( parts < MIN_PARTS || parts > hash_len ) ) {
+      die( "Parts must be between %u and %u", MIN_PARTS, hash_len );
+    }
+    /* Queries are only compared with the dump, so with --knn the dump
+     * is indexed and otherwise the queries are
+     */
+    if ( query && !knn ) {
+      filed = &queries;
+      base = data.count;
+    }
+    row = query || knn ? filed->count : filed->count / 2.0;
+    if ( parts && radius / parts >= hash_len / parts ) {
+      die( "With %lu parts the radius must be less than %lu", parts,
+           hash_len / parts * parts );
+    }
+    if ( parts && mih_cost( filed->count, radius, parts ) >= row ) {
+      fprintf( stderr, "Warning: an index of %lu parts can't beat "
+               "comparing every pair at radius %lu, comparing every "
+               "pair\n", parts, radius );
+      parts = 0;
+    }
+    else if ( !parts && !( parts = choose_parts( filed->count, row,
+                                                 radius ) ) ) {
+      mention( "An index can't beat comparing every pair at radius %lu, "
+               "comparing every pair", radius );
+    }
+    if ( parts ) {
+      start = now(  );
+      index = new_mih( filed, base, parts, radius );
+      mention( "Indexed %lu substrings per hash, probing each within %lu "
+               "bits, in %.2fs", parts, radius / parts, now(  ) - start );
+    }
+  }
+
+  init_job( &job, search, query ? &queries : NULL, index,
+            MIN( MIN( radius, max_distance ), hash_len ), knn, from, stream,
+            sort || groups != ULONG_MAX, sweep, tiled );
+  job.format = format;
+  if ( query ) {
+    job.cross = 1;
+    if ( knn ) {
+      set_rows( &job, from, job.count );
+    }
+    else {
+      set_rows( &job, 0, from );
+    }
+  }
+  else if ( nmerge ) {
+    set_rows( &job, 0, 0 );
+  }
+  else if ( shards > 1 ) {
+    set_shard( &job, shard, shards );
+    mention( "Shard %u/%u is rows %lu to %lu, %lu pairs", shard, shards,
+             ( unsigned long ) job.start, ( unsigned long ) job.end,
+             job.total );
+  }
+  else if ( rows != ULONG_MAX ) {
+    set_rows( &job, 0, rows );
+  }
+  if ( stats ) {
+    job.thread = safe_malloc( sizeof( struct counts ) * threads );
+    memset( job.thread, 0, sizeof( struct counts ) * threads );
+  }
+
+  start = now(  );
+  stage[STAGE_PREPARE] = start - mark;
+  if ( budget ) {
+    size_t per = budget * 1048576 / ( 3 * ( hash_bytes + SUMMARY_LEN ) );
+    if ( per < TILE_ROWS ) {
+      die( "--budget must allow for at least %u hashes a block",
+           TILE_ROWS );
+    }
+    job.searched = hdr.count;
+    correlate_blocks( fd, &hdr, MIN( per, MAX( hdr.count, 1 ) ), nent,
+                      threads, tiled, &top, &job.n, job.thread, &job.total );
+  }
+  else if ( threads > 1 ) {
+    correlate_threaded( &job, nent, threads, &top );
+  }
+  else {
+    correlate( &job, nent, &top );
+  }
+  elapsed = stage[STAGE_SEARCH] = now(  ) - start;
+  mark = now(  );
+  mention( "Compared %lu pairs in %.2fs (%.0f pairs/s)",
+           job.n.examined, elapsed,
+           elapsed > 0 ? job.n.examined / elapsed : 0 );
+  if ( index ) {
+    mention( "Examined %lu candidates of %lu pairs (%.4f%%)",
+             job.n.examined, job.total,
+             job.total ? 100.0 * job.n.examined / job.total : 0 );
+  }
+  mention( "Of %lu pairs: %lu skipped by %s, %lu by summary bound, "
+           "%lu compared", job.total,
+           index ? job.total - job.n.examined : job.n.swept,
+           index ? "index" : "sweep", job.n.bounded, job.n.evaluated );
+  if ( bounded_kernel ) {
+    mention( "Gave up early on %lu of %lu distances, comparing %.2f of %u "
+             "segments on average", job.n.aborted, job.n.evaluated,
+             job.n.evaluated ? ( double ) job.n.segments / job.n.evaluated
+             : 0, SEGMENTS );
+  }
+
+  if ( dedup ) {
+    struct top_k found = top;
+    double all = data.count * ( data.count - 1.0 ) / 2;
+    start = now(  );
+    expand_copies( &top, &found, &dd );
+    mention( "Added the pairs of copies in %.2fs, skipping %.0f pairs, "
+             "about %.2fs at %.0f pairs/s", now(  ) - start,
+             all - job.total, job.total ? ( all - job.total ) * elapsed
+             / job.total : 0, elapsed > 0 ? job.total / elapsed : 0 );
+  }
+
+  if ( previous ) {
+    struct state_header hdr;
+    mention( "Merging pairs from %s", previous );
+    load_top_k( previous, &top, &data, from, job.radius, &hdr );
+    if ( hdr.shards != 1 ) {
+      die( "%s is only one shard of a search", previous );
+    }
+  }
+  if ( nmerge ) {
+    merge_shards( merge, nmerge, &top, &data, job.radius );
+  }
+  if ( save ) {
+    mention( "Saving pairs to %s", save );
+    save_top_k( save, &top, &data, shard, shards );
+  }
+  c = resolve_correlation( &top, &nused );
+  stage[STAGE_FINISH] = now(  ) - mark;
+  mark = now(  );
+
+  if ( stream ) {
+    mention( "Found %lu pairs", job.n.found );
+  }
+  if ( stream && groups != ULONG_MAX ) {
+    struct groups g;
+    size_t written;
+    start = now(  );
+    init_groups( &g, data.count + queries.count );
+    read_groups( stream, job.n.found, &g );
+    fclose( stream );
+    written = show_groups( &g, &data, &queries,
+                           MIN( group_radius, UINT_MAX ), format );
+    free_groups( &g );
+    mention( "Wrote %lu groups in %.2fs", ( unsigned long ) written,
+             now(  ) - start );
+  }
+  else if ( stream && sort ) {
+    struct writer out;
+    start = now(  );
+    init_writer( &out, stdout, format, NULL );
+    sort_pairs( stream, job.n.found, &out, &data, &queries );
+    free_writer( &out );
+    mention( "Sorted %lu pairs in %.2fs", job.n.found, now(  ) - start );
+  }
+  else if ( knn ) {
+    show_neighbours( &job, format );
+  }
+  else if ( shards > 1 ) {
+    /* The pairs of one shard are only part of the answer */
+    mention( "Not writing the pairs of shard %u/%u, --merge them with "
+             "those of the other shards", shard, shards );
+  }
+  else {
+    if ( budget && format == OUT_HEX ) {
+      read_pairs( fd, &hdr, c, nused, &data );
+    }
+    show_correlation( &data, &queries, c, nused, format );
+  }
+  stage[STAGE_OUTPUT] = now(  ) - mark;
+  if ( stats ) {
+    write_stats( stats, &job,
+                 budget ? hdr.count : data.count + queries.count, nent,
+                 threads, kernel_name, stage );
+    free( job.thread );
+  }
   free_correlation( c );
-  free_phash( data );
+  free( merge );
+  free_job( &job );
+  free_mih( index );
+  if ( dedup ) {
+    free_dedup( &dd );
+  }
+  free_phash( &data );
+  free_phash( &queries );
+  if ( fd >= 0 ) {
+    close( fd );
+  }
 
   return 0;
 }
@@ -8,22 +8,81 @@
 #include <limits.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define CHUNKSAMPS 11025
 #define CHUNKBYTES 4 * CHUNKSAMPS
 #define NUM_BANDS 4
-#define MAXCHUNKS 65536         /* 4.5 hours */
+#define MINCHUNKS 512           /* room for at first, grows as needed */
+#define PLAN_CACHE 16           /* track lengths to keep plans for */
+#define SPLINE_POINTS 256       /* per metric, as spline -n 255 */
+#define SPLINE_K 1.0            /* ends: z[0] = k z[1], spline's default */
+#define SPLINE_PRECISION 6      /* significant digits, as spline writes */
+#define METRICS 3
+#define HASH_BYTES ( METRICS * SPLINE_POINTS / 8 )
+#define PROG "fdmf_sonic_reducer"
 
 typedef fftw_complex f_c;
 typedef fftw_plan f_p;
 
+/* What to write for each track */
+enum {
+  OUT_VALUES,                   /* the spline values, one to a line */
+  OUT_HEX,                      /* the hash in hex on one line */
+  OUT_RAW                       /* the hash, HASH_BYTES of it */
+};
+
+/* Where the time goes, for --timings */
+enum {
+  STAGE_READ,
+  STAGE_MONO,                   /* to mono, windowed */
+  STAGE_CHUNK_FFT,
+  STAGE_BANDS,
+  STAGE_TRACK_FFT,
+  STAGE_SPLINE,
+  STAGE_OUTPUT,
+  STAGES
+};
+
+static const char *stage_name[STAGES] = {
+  "read", "mono", "chunk fft", "bands", "track fft", "spline", "output"
+};
+
+/* A plan for the transform of the metrics of a track of len chunks and
+ * the window that goes with it. The plan is made on scratch buffers and
+ * run on each metric with fftw_execute_dft().
+ */
+struct track_plan {
+  int len;
+  f_p plan;
+  double *window;
+};
+
+/* Everything that can be set up once and used for every track */
+struct reducer {
+  f_c *ebuf, *rbuf, *tbuf;      /* the metrics of each chunk */
+  f_c *eout, *rout, *tout;      /* and their spectra */
+  int size;                     /* chunks there's room for */
+  f_c *in;                      /* a chunk */
+  f_c *out;                     /* and its spectrum */
+  f_p chunk_plan;
+  double *chunk_window;
+  struct track_plan plan[PLAN_CACHE];
+  int nplans, next_plan;
+  unsigned flags;               /* for the planner */
+  int format;                   /* OUT_* */
+  int timings;                  /* keep track of stage[] */
+  double stage[STAGES], mark;   /* seconds in each, and when the last ended */
+};
+
 /*
 This program reads raw 16-bit stereo native endian audio data on
 STDIN and writes to STDOUT the power spectra of the chunk metrics.
@@ -32,10 +91,27 @@ summary value that is stored in the fdmf database/index/cache.
 The output spectra come out concatenated withg no delimiter.
 256 compenents/metric * 3 metrics = 768 values (ascii floats).
 This program uses FFTW for calculating the FFT and
-uses GNU Plotutils for spline fitting the spectra
-to a standard set of frequency points.  
+fits a cubic spline to the spectra to resample them
+at a standard set of frequency points, as GNU Plotutils'
+spline -I a -n 255 -s would. --spline does just that
+to points read from STDIN.
+
+With --batch, or given files to read, it stays running and reduces
+one track after another, reusing its buffers and FFTW plans. Each
+result is followed by an empty line.
 */
 
+static void
+die( const char *msg, ... ) {
+  va_list ap;
+  va_start( ap, msg );
+  fprintf( stderr, PROG ": " );
+  vfprintf( stderr, msg, ap );
+  fprintf( stderr, "\n" );
+  va_end( ap );
+  exit( 1 );
+}
+
 static void
 pad( int bufbytes, char *buf, int byte_count ) {
   int i;
@@ -69,22 +145,87 @@ read_from_fd( int fd, char *buf, int size ) {
   return ( i );
 }
 
+static double
+now( void ) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Charge the time since the last lap to stage */
+static void
+lap( struct reducer *rd, int stage ) {
+  double t;
+  if ( !rd->timings ) {
+    return;
+  }
+  t = now(  );
+  rd->stage[stage] += t - rd->mark;
+  rd->mark = t;
+}
+
 static void
-setup_bufs( fftw_complex ** ebuf, fftw_complex ** eout,
-            fftw_complex ** rbuf, fftw_complex ** rout,
-            fftw_complex ** tbuf, fftw_complex ** tout ) {
-  *ebuf = fftw_malloc( sizeof( fftw_complex ) * MAXCHUNKS );
-  assert( ebuf != NULL );
-  *eout = fftw_malloc( sizeof( fftw_complex ) * MAXCHUNKS );
-  assert( eout != NULL );
-  *rbuf = fftw_malloc( sizeof( fftw_complex ) * MAXCHUNKS );
-  assert( rbuf != NULL );
-  *rout = fftw_malloc( sizeof( fftw_complex ) * MAXCHUNKS );
-  assert( rout != NULL );
-  *tbuf = fftw_malloc( sizeof( fftw_complex ) * MAXCHUNKS );
-  assert( tbuf != NULL );
-  *tout = fftw_malloc( sizeof( fftw_complex ) * MAXCHUNKS );
-  assert( tout != NULL );
+show_timings( const struct reducer *rd ) {
+  double total = 0;
+  int i;
+  for ( i = 0; i < STAGES; i++ ) {
+    total += rd->stage[i];
+  }
+  for ( i = 0; i < STAGES; i++ ) {
+    fprintf( stderr, "%-10s %10.3fs %5.1f%%\n", stage_name[i], rd->stage[i],
+             total > 0 ? 100 * rd->stage[i] / total : 0 );
+  }
+  fprintf( stderr, "%-10s %10.3fs\n", "total", total );
+}
+
+/* Read and throw away len bytes */
+static void
+skip_fd( int fd, uint64_t len ) {
+  char buf[CHUNKBYTES];
+  while ( len ) {
+    int want = len < sizeof( buf ) ? ( int ) len : ( int ) sizeof( buf );
+    int got = read_from_fd( fd, buf, want );
+    if ( got < want ) {
+      die( "Unexpected end of input" );
+    }
+    len -= got;
+  }
+}
+
+/* The rest of the new buffer is zeroed, which is what keeps the
+ * imaginary parts of the metrics 0.
+ */
+static void *
+grow_buf( void *buf, size_t used, size_t size ) {
+  void *nb = fftw_malloc( size );
+  if ( nb == NULL ) {
+    die( "Out of memory for %lu bytes", ( unsigned long ) size );
+  }
+  if ( used ) {
+    memcpy( nb, buf, used );
+  }
+  memset( ( char * ) nb + used, 0, size - used );
+  fftw_free( buf );
+  return nb;
+}
+
+/* Make room for twice as many chunks, keeping the metrics of the first
+ * used. The spectra have nothing worth keeping between tracks.
+ */
+static void
+grow_bufs( struct reducer *rd, int used ) {
+  int size = rd->size ? rd->size * 2 : MINCHUNKS;
+  size_t keep = sizeof( f_c ) * used, mb = sizeof( f_c ) * size;
+  if ( rd->size > INT_MAX / 2 ) {
+    die( "Track is too long" );
+  }
+  rd->ebuf = grow_buf( rd->ebuf, keep, mb );
+  rd->rbuf = grow_buf( rd->rbuf, keep, mb );
+  rd->tbuf = grow_buf( rd->tbuf, keep, mb );
+  rd->eout = grow_buf( rd->eout, 0, mb );
+  rd->rout = grow_buf( rd->rout, 0, mb );
+  rd->tout = grow_buf( rd->tout, 0, mb );
+  rd->size = size;
 }
 
 static double *
@@ -128,21 +269,31 @@ calc_band_energies( fftw_complex * out, double *be ) {
   }                             /* post: be[] is full of the band energies */
 }
 
+/* Mix a chunk down to mono and window it in one pass. The sum of two
+ * samples is exact, so this is the same as windowing afterwards.
+ */
 static void
-audio_to_fftw( char *buf, fftw_complex * in ) {
-  unsigned char *dp = ( unsigned char * ) buf;
+audio_to_fftw( const int16_t *buf, f_c * in, const double *win_tbl ) {
   int i;
+#if defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  /* A plain loop over the samples, which the compiler vectorises */
+  for ( i = 0; i < CHUNKSAMPS; i++ ) {
+    in[i][0] = ( double ) ( buf[2 * i] + buf[2 * i + 1] ) * win_tbl[i];
+  }
+#else
+  const unsigned char *dp = ( const unsigned char * ) buf;
   for ( i = 0; i < CHUNKSAMPS; i++ ) {
     /* Cast to short to force sign extension. Is this portable? */
     double left = ( short ) ( dp[0] | ( dp[1] << 8 ) );
     double right = ( short ) ( dp[2] | ( dp[3] << 8 ) );
     dp += 4;
-    in[i][0] = left + right;
+    in[i][0] = ( left + right ) * win_tbl[i];
   }
+#endif
 }
 
 static void
-window( f_c * buf, double *win_tbl, int len ) {
+window( f_c * buf, const double *win_tbl, int len ) {
   int i;
   for ( i = 0; i < len; i++ ) {
     buf[i][0] *= win_tbl[i];
@@ -173,45 +324,77 @@ chunk_metrics( double *be, f_c * e, f_c * r, f_c * t, int chunk ) {
   t[chunk][0] = twist;
 }
 
+/* Reads the audio of a track from fd, at most len bytes of it, and
+ * returns the number of chunks. Whatever is left of len is read and
+ * thrown away.
+ */
 static int
-calc_chunk_metrics( f_c * ebuf, f_c * rbuf, f_c * tbuf ) {
-  char buf[CHUNKBYTES];
-  double *chunk_window;
+calc_chunk_metrics( struct reducer *rd, int fd, uint64_t len ) {
+  int16_t buf[2 * CHUNKSAMPS];
   int chunkcount = 0;
-  f_c *in, *out;
-  f_p p;
-  in = fftw_malloc( sizeof( f_c ) * CHUNKSAMPS );
-  assert( in != NULL );
-  out = fftw_malloc( sizeof( f_c ) * CHUNKSAMPS );
-  assert( out != NULL );
-  p = fftw_plan_dft_1d( CHUNKSAMPS, in, out, FFTW_FORWARD, FFTW_ESTIMATE );
-  chunk_window = setup_window( CHUNKSAMPS );
-  while ( CHUNKBYTES == read_from_fd( 0, buf, CHUNKBYTES ) ) {
+  uint64_t left = len;
+  while ( left >= CHUNKBYTES ) {
     /* Forget about the last fraction of a second of audio data. */
     /* Process exactly one second of audio data per iteration. */
     double be[NUM_BANDS];       /* band energies */
-    audio_to_fftw( buf, in );
-    window( in, chunk_window, CHUNKSAMPS );
-    fftw_execute( p );          /* post: in[] -> FFT -> out[] is done */
-    calc_band_energies( out, be );      /* post: be[] is valid */
-    chunk_metrics( be, ebuf, rbuf, tbuf, chunkcount );
+    if ( CHUNKBYTES != read_from_fd( fd, ( char * ) buf, CHUNKBYTES ) ) {
+      if ( len != UINT64_MAX ) {
+        die( "Unexpected end of input" );
+      }
+      break;
+    }
+    if ( chunkcount == rd->size ) {
+      grow_bufs( rd, chunkcount );
+    }
+    left -= CHUNKBYTES;
+    lap( rd, STAGE_READ );
+    audio_to_fftw( buf, rd->in, rd->chunk_window );
+    lap( rd, STAGE_MONO );
+    fftw_execute( rd->chunk_plan );     /* post: in[] -> FFT -> out[] */
+    lap( rd, STAGE_CHUNK_FFT );
+    calc_band_energies( rd->out, be );  /* post: be[] is valid */
+    chunk_metrics( be, rd->ebuf, rd->rbuf, rd->tbuf, chunkcount );
+    lap( rd, STAGE_BANDS );
     chunkcount++;
     /* post: ebuf[], rbuf[], and tbuf[] have chunkcount valid elements */
   }                             /* post: we got to the end of the input data */
-  fftw_free( in );
-  fftw_free( out );
-  fftw_destroy_plan( p );
-  free( chunk_window );
+  if ( len != UINT64_MAX ) {
+    skip_fd( fd, left );
+  }
+  lap( rd, STAGE_READ );
   return chunkcount;
 }
 
-static void
-setup_plans( int c, f_p * ep, f_p * rp, f_p * tp,
-             f_c * ebuf, f_c * rbuf, f_c * tbuf,
-             f_c * eout, f_c * rout, f_c * tout ) {
-  *ep = fftw_plan_dft_1d( c, ebuf, eout, FFTW_FORWARD, FFTW_ESTIMATE );
-  *rp = fftw_plan_dft_1d( c, rbuf, rout, FFTW_FORWARD, FFTW_ESTIMATE );
-  *tp = fftw_plan_dft_1d( c, tbuf, tout, FFTW_FORWARD, FFTW_ESTIMATE );
+/* Find or make the plan for a track of c chunks. New plans are made on
+ * the output buffers, which hold nothing yet, so that planning with
+ * FFTW_MEASURE doesn't destroy the metrics.
+ */
+static struct track_plan *
+find_plan( struct reducer *rd, int c ) {
+  struct track_plan *tp;
+  int i;
+  for ( i = 0; i < rd->nplans; i++ ) {
+    if ( rd->plan[i].len == c ) {
+      return &rd->plan[i];
+    }
+  }
+  if ( rd->nplans < PLAN_CACHE ) {
+    tp = &rd->plan[rd->nplans++];
+  }
+  else {
+    tp = &rd->plan[rd->next_plan];
+    rd->next_plan = ( rd->next_plan + 1 ) % PLAN_CACHE;
+    fftw_destroy_plan( tp->plan );
+    free( tp->window );
+  }
+  tp->len = c;
+  tp->plan = fftw_plan_dft_1d( c, rd->eout, rd->rout, FFTW_FORWARD,
+                               rd->flags );
+  if ( tp->plan == NULL ) {
+    die( "Can't plan a transform of %d points", c );
+  }
+  tp->window = setup_window( c );
+  return tp;
 }
 
 static void
@@ -226,19 +409,156 @@ free_bufs( f_c * ebuf, f_c * eout, f_c * rbuf,
 }
 
 static void
-destroy_plans( fftw_plan ep, fftw_plan rp, fftw_plan tp ) {
-  fftw_destroy_plan( ep );
-  fftw_destroy_plan( rp );
-  fftw_destroy_plan( tp );
+setup_reducer( struct reducer *rd, unsigned flags ) {
+  rd->ebuf = rd->rbuf = rd->tbuf = NULL;
+  rd->eout = rd->rout = rd->tout = NULL;
+  rd->size = 0;
+  grow_bufs( rd, 0 );
+  rd->in = fftw_malloc( sizeof( f_c ) * CHUNKSAMPS );
+  assert( rd->in != NULL );
+  rd->out = fftw_malloc( sizeof( f_c ) * CHUNKSAMPS );
+  assert( rd->out != NULL );
+  rd->flags = flags;
+  rd->chunk_plan = fftw_plan_dft_1d( CHUNKSAMPS, rd->in, rd->out,
+                                     FFTW_FORWARD, flags );
+  /* Only the real parts are filled in from here on */
+  memset( rd->in, 0, sizeof( f_c ) * CHUNKSAMPS );
+  rd->chunk_window = setup_window( CHUNKSAMPS );
+  rd->nplans = rd->next_plan = 0;
+  rd->format = OUT_VALUES;
+  rd->timings = 0;
+  memset( rd->stage, 0, sizeof( rd->stage ) );
 }
 
 static void
-do_spline( fftw_complex * spline_in, int c ) {
-  FILE *spline;
+free_reducer( struct reducer *rd ) {
   int i;
-  spline = popen( "spline -I a -n 255 -s", "w" );
-  assert( spline != NULL );
-  for ( i = 0; i < c / 2; i++ ) {
+  for ( i = 0; i < rd->nplans; i++ ) {
+    fftw_destroy_plan( rd->plan[i].plan );
+    free( rd->plan[i].window );
+  }
+  fftw_destroy_plan( rd->chunk_plan );
+  free( rd->chunk_window );
+  fftw_free( rd->in );
+  fftw_free( rd->out );
+  free_bufs( rd->ebuf, rd->eout, rd->rbuf, rd->rout, rd->tbuf, rd->tout );
+}
+
+/* Round to six decimal places as printing with %f and reading back did
+ * when the points were piped to spline.
+ */
+static double
+round_like_f( double v ) {
+  return rint( v * 1e6 ) / 1e6;
+}
+
+/*
+Fit a cubic spline through the n points (t[], y[]), t[] ascending,
+and put its second derivative at each of them in z[]. This is the
+zero tension spline that spline(1) fits: z[0] = k z[1] and
+z[n-1] = k z[n-2] at the ends, and a tridiagonal system for the
+rest, solved by elimination and back substitution. u[] and v[] are
+scratch space for n doubles each.
+*/
+
+static void
+spline_fit( const double *t, const double *y, int n, double *z,
+            double *u, double *v ) {
+  int i, last = n - 2;          /* interior points are 1 .. last */
+  for ( i = 0; i < n; i++ ) {
+    z[i] = 0;
+  }
+  if ( n < 3 ) {
+    return;                     /* a straight line */
+  }
+  for ( i = 1; i <= last; i++ ) {
+    double h0 = t[i] - t[i - 1], h1 = t[i + 1] - t[i];
+    u[i] = 2 * ( h0 + h1 );
+    v[i] = 6 * ( ( y[i + 1] - y[i] ) / h1 - ( y[i] - y[i - 1] ) / h0 );
+    if ( i == 1 ) {
+      u[i] += SPLINE_K * h0;
+    }
+    if ( i == last ) {
+      u[i] += SPLINE_K * h1;
+    }
+    if ( i > 1 ) {
+      double m = h0 / u[i - 1];
+      u[i] -= m * h0;
+      v[i] -= m * v[i - 1];
+    }
+  }
+  z[last] = v[last] / u[last];
+  for ( i = last - 1; i >= 1; i-- ) {
+    z[i] = ( v[i] - ( t[i + 1] - t[i] ) * z[i + 1] ) / u[i];
+  }
+  z[0] = SPLINE_K * z[1];
+  z[n - 1] = SPLINE_K * z[n - 2];
+}
+
+/* Evaluate the spline through the n points at SPLINE_POINTS evenly
+ * spaced points from the first to the last.
+ */
+static void
+spline_eval( const double *t, const double *y, const double *z, int n,
+             double *out ) {
+  double spacing = n > 1 ? ( t[n - 1] - t[0] ) / ( SPLINE_POINTS - 1 ) : 0;
+  int i = 0, j;
+  for ( j = 0; j < SPLINE_POINTS; j++ ) {
+    double x = t[0] + j * spacing, value = y[0];
+    if ( n > 1 ) {
+      double h, a, b;
+      while ( i < n - 2 && x > t[i + 1] ) {
+        i++;
+      }
+      h = t[i + 1] - t[i];
+      a = t[i + 1] - x;
+      b = x - t[i];
+      value = ( z[i] * a * a * a + z[i + 1] * b * b * b ) / ( 6 * h )
+          + ( y[i] / h - h * z[i] / 6 ) * a
+          + ( y[i + 1] / h - h * z[i + 1] / 6 ) * b;
+    }
+    out[j] = value;
+  }
+}
+
+static void
+write_values( const double *value, int n ) {
+  int i;
+  for ( i = 0; i < n; i++ ) {
+    printf( "%.*g\n", SPLINE_PRECISION, value[i] );
+  }
+}
+
+/* Fit the spline through n points, n > 0, and evaluate it */
+static void
+spline_points( const double *t, const double *y, int n, double *out ) {
+  double *z = malloc( sizeof( double ) * 3 * n );
+  if ( z == NULL ) {
+    perror( "malloc for spline" );
+    exit( 1 );
+  }
+  spline_fit( t, y, n, z, z + n, z + 2 * n );
+  spline_eval( t, y, z, n, out );
+  free( z );
+}
+
+/* Resample the spectrum of c points at SPLINE_POINTS into out. Returns
+ * 0, and leaves out alone, if there's too little of it.
+ */
+static int
+do_spline( fftw_complex * spline_in, int c, double *out ) {
+  int i, n = c / 2;
+  double *t, *y;
+  if ( n == 0 ) {
+    return 0;
+  }
+  t = malloc( sizeof( double ) * 2 * n );
+  if ( t == NULL ) {
+    perror( "malloc for spline" );
+    exit( 1 );
+  }
+  y = t + n;
+  for ( i = 0; i < n; i++ ) {
     double re, im, mag, freq;
     freq = ( double ) i / ( double ) c;
     re = spline_in[i][0];
@@ -247,34 +567,325 @@ do_spline( fftw_complex * spline_in, int c ) {
     /* this is a hack to get rid of crazy points at LF */
     if ( i < 2 )
       mag = 0;
-    fprintf( spline, "%f %f\n", freq, mag );
+    t[i] = round_like_f( freq );
+    y[i] = round_like_f( mag );
   }
-  pclose( spline );
+  spline_points( t, y, n, out );
+  free( t );
+  return 1;
 }
 
-int
-main( void ) {
-  f_c *ebuf, *eout, *rbuf, *rout, *tbuf, *tout;
-  f_p ep, rp, tp;
+/* Like spline -I a -n 255 -s: read points, an abscissa and an ordinate
+ * each, from STDIN and write the spline through them.
+ */
+static void
+spline_stdin( void ) {
+  double *t = NULL, *y = NULL, a, b;
+  int n = 0, size = 0;
+  while ( scanf( "%lf %lf", &a, &b ) == 2 ) {
+    if ( n == size ) {
+      size = size ? size * 2 : 1024;
+      t = realloc( t, sizeof( double ) * size );
+      y = realloc( y, sizeof( double ) * size );
+      if ( t == NULL || y == NULL ) {
+        perror( "realloc for spline" );
+        exit( 1 );
+      }
+    }
+    if ( n && a <= t[n - 1] ) {
+      die( "Abscissas must be ascending" );
+    }
+    t[n] = a;
+    y[n] = b;
+    n++;
+  }
+  if ( !feof( stdin ) ) {
+    die( "Bad point" );
+  }
+  if ( n ) {
+    double out[SPLINE_POINTS];
+    spline_points( t, y, n, out );
+    write_values( out, SPLINE_POINTS );
+  }
+  free( t );
+  free( y );
+}
+
+/* The value as it was written with SPLINE_PRECISION digits for fdmf to
+ * read back, so that the hash comes out the same as fdmf's did.
+ */
+static double
+as_written( double v ) {
+  char buf[40];
+  snprintf( buf, sizeof( buf ), "%.*g", SPLINE_PRECISION, v );
+  return strtod( buf, NULL );
+}
+
+/* Return the k-th smallest of the n values in v, which are reordered */
+static double
+select_kth( double *v, int n, int k ) {
+  int lo = 0, hi = n - 1;
+  while ( lo < hi ) {
+    double pivot = v[( lo + hi ) / 2], t;
+    int i = lo, j = hi;
+    while ( i <= j ) {
+      while ( v[i] < pivot ) {
+        i++;
+      }
+      while ( v[j] > pivot ) {
+        j--;
+      }
+      if ( i <= j ) {
+        t = v[i];
+        v[i++] = v[j];
+        v[j--] = t;
+      }
+    }
+    if ( k <= j ) {
+      hi = j;
+    }
+    else if ( k >= i ) {
+      lo = i;
+    }
+    else {
+      break;
+    }
+  }
+  return v[k];
+}
+
+/* Set a bit for each of the n values above their median, the upper one
+ * of the middle two as fdmf's median() had it, from bit first of hash
+ * on, least significant bit of each byte first.
+ */
+static void
+quantize( const double *value, int n, unsigned char *hash, int first ) {
+  double v[SPLINE_POINTS], median;
+  int i;
+  for ( i = 0; i < n; i++ ) {
+    v[i] = as_written( value[i] );
+  }
+  median = select_kth( v, n, n / 2 );
+  for ( i = 0; i < n; i++ ) {
+    if ( as_written( value[i] ) > median ) {
+      hash[( first + i ) / 8] |= 1 << ( ( first + i ) % 8 );
+    }
+  }
+}
+
+static void
+write_hash( const double value[METRICS][SPLINE_POINTS], int format ) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char hash[HASH_BYTES];
+  int m, i;
+  memset( hash, 0, sizeof( hash ) );
+  for ( m = 0; m < METRICS; m++ ) {
+    quantize( value[m], SPLINE_POINTS, hash, m * SPLINE_POINTS );
+  }
+  if ( format == OUT_RAW ) {
+    fwrite( hash, 1, sizeof( hash ), stdout );
+    return;
+  }
+  for ( i = 0; i < HASH_BYTES; i++ ) {
+    putchar( hex[hash[i] >> 4] );
+    putchar( hex[hash[i] & 15] );
+  }
+  putchar( '\n' );
+}
+
+/* Reduce the track of at most len bytes read from fd. A track shorter
+ * than two chunks gives no output, or with --format raw is an error.
+ */
+static void
+reduce_track( struct reducer *rd, int fd, uint64_t len ) {
+  double value[METRICS][SPLINE_POINTS];
+  struct track_plan *tp;
   int chunks;
-  double *track_window;
-  setup_bufs( &ebuf, &eout, &rbuf, &rout, &tbuf, &tout );
-  chunks = calc_chunk_metrics( ebuf, rbuf, tbuf );
+  rd->mark = rd->timings ? now(  ) : 0;
+  chunks = calc_chunk_metrics( rd, fd, len );
   /* ebuf[], rbuf[], and tbuf[] each have chunks valid elements */
-  setup_plans( chunks, &ep, &rp, &tp, ebuf, rbuf, tbuf, eout, rout, tout );
-  track_window = setup_window( chunks );
-  window( ebuf, track_window, chunks );
-  window( rbuf, track_window, chunks );
-  window( tbuf, track_window, chunks );
-  fftw_execute( ep );
-  fftw_execute( rp );
-  fftw_execute( tp );
+  if ( chunks < 2 ) {
+    if ( rd->format == OUT_RAW ) {
+      die( "Track is too short to hash" );
+    }
+    return;
+  }
+  tp = find_plan( rd, chunks );
+  window( rd->ebuf, tp->window, chunks );
+  window( rd->rbuf, tp->window, chunks );
+  window( rd->tbuf, tp->window, chunks );
+  fftw_execute_dft( tp->plan, rd->ebuf, rd->eout );
+  fftw_execute_dft( tp->plan, rd->rbuf, rd->rout );
+  fftw_execute_dft( tp->plan, rd->tbuf, rd->tout );
   /* now eout[], rout[], and tout[] are valid */
-  do_spline( eout, chunks );
-  do_spline( rout, chunks );
-  do_spline( tout, chunks );
-  free_bufs( ebuf, eout, rbuf, rout, tbuf, tout );
-  free( track_window );
-  destroy_plans( ep, rp, tp );
+  lap( rd, STAGE_TRACK_FFT );
+  do_spline( rd->eout, chunks, value[0] );
+  do_spline( rd->rout, chunks, value[1] );
+  do_spline( rd->tout, chunks, value[2] );
+  lap( rd, STAGE_SPLINE );
+  if ( rd->format == OUT_VALUES ) {
+    write_values( &value[0][0], METRICS * SPLINE_POINTS );
+  }
+  else {
+    write_hash( value, rd->format );
+  }
+  lap( rd, STAGE_OUTPUT );
+}
+
+/* Mark the end of a result in batch mode; raw hashes are all the same
+ * size and need no help
+ */
+static void
+end_result( const struct reducer *rd ) {
+  if ( rd->format != OUT_RAW ) {
+    printf( "\n" );
+  }
+  fflush( stdout );
+}
+
+/* Reduce each of the tracks framed on stdin: a native uint64_t count of
+ * bytes followed by that many bytes of audio.
+ */
+static void
+reduce_batch( struct reducer *rd ) {
+  uint64_t len;
+  int got;
+  while ( got = read_from_fd( 0, ( char * ) &len, sizeof( len ) ), got ) {
+    if ( got != sizeof( len ) ) {
+      die( "Truncated frame header" );
+    }
+    reduce_track( rd, 0, len );
+    end_result( rd );
+  }
+}
+
+static void
+usage( void ) {
+  fprintf( stderr, "Usage: " PROG " [options] [file...] < audio\n\n"
+           "Reduce raw 16 bit stereo audio to the spectra of its chunk\n"
+           "metrics. Given files, reduce each of them in turn; they may be\n"
+           "pipes or /dev/fd/N for descriptors passed in.\n\n"
+           "Options:\n"
+           "  -f, --format  <F> Write values, the spline values as before\n"
+           "                    (the default), hex for the hash fdmf makes\n"
+           "                    of them, or raw for the same %d bytes\n"
+           "  -s, --spline      Just fit a spline to the points on stdin, as\n"
+           "                    spline -I a -n 255 -s would\n"
+           "  -b, --batch       Reduce the tracks framed on stdin, each a\n"
+           "                    native 64 bit byte count and the audio\n"
+           "  -w, --wisdom  <F> Load FFTW wisdom from F if it exists and\n"
+           "                    save it there at exit\n"
+           "  -m, --measure     Plan transforms with FFTW_MEASURE; slow to\n"
+           "                    start without --wisdom\n"
+           "  -T, --timings     Show the time spent in each stage at exit\n"
+           "  -h, --help        See this text\n\n"
+           "In batch mode, or with files, each result but a raw hash is\n"
+           "followed by an empty line.\n", HASH_BYTES );
+  exit( 1 );
+}
+
+int
+main( int argc, char *argv[] ) {
+  struct reducer rd;
+  const char *wisdom = NULL;
+  unsigned flags = FFTW_ESTIMATE;
+  int batch = 0, spline = 0, format = OUT_VALUES, timings = 0;
+  int ch, i;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"batch", no_argument, NULL, 'b'},
+    {"spline", no_argument, NULL, 's'},
+    {"format", required_argument, NULL, 'f'},
+    {"wisdom", required_argument, NULL, 'w'},
+    {"measure", no_argument, NULL, 'm'},
+    {"timings", no_argument, NULL, 'T'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ( ch = getopt_long( argc, argv, "hbsf:w:mT", opts, NULL ), ch != -1 ) {
+    switch ( ch ) {
+    case 'b':
+      batch = 1;
+      break;
+    case 's':
+      spline = 1;
+      break;
+    case 'f':
+      if ( !strcmp( optarg, "values" ) ) {
+        format = OUT_VALUES;
+      }
+      else if ( !strcmp( optarg, "hex" ) ) {
+        format = OUT_HEX;
+      }
+      else if ( !strcmp( optarg, "raw" ) ) {
+        format = OUT_RAW;
+      }
+      else {
+        die( "Unknown format %s", optarg );
+      }
+      break;
+    case 'w':
+      wisdom = optarg;
+      break;
+    case 'm':
+      flags = FFTW_MEASURE;
+      break;
+    case 'T':
+      timings = 1;
+      break;
+    case 'h':
+    default:
+      usage(  );
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if ( spline ) {
+    spline_stdin(  );
+    return ( 0 );
+  }
+
+  if ( batch && argc ) {
+    die( "--batch reads stdin, it can't be given files" );
+  }
+
+  if ( wisdom && access( wisdom, F_OK ) == 0
+       && !fftw_import_wisdom_from_filename( wisdom ) ) {
+    die( "Can't load wisdom from %s", wisdom );
+  }
+
+  setup_reducer( &rd, flags );
+  rd.format = format;
+  rd.timings = timings;
+
+  if ( batch ) {
+    reduce_batch( &rd );
+  }
+  else if ( argc ) {
+    for ( i = 0; i < argc; i++ ) {
+      int fd = open( argv[i], O_RDONLY );
+      if ( fd < 0 ) {
+        die( "Can't read %s", argv[i] );
+      }
+      reduce_track( &rd, fd, UINT64_MAX );
+      close( fd );
+      end_result( &rd );
+    }
+  }
+  else {
+    reduce_track( &rd, 0, UINT64_MAX );
+  }
+
+  if ( wisdom && !fftw_export_wisdom_to_filename( wisdom ) ) {
+    die( "Can't save wisdom to %s", wisdom );
+  }
+
+  if ( timings ) {
+    show_timings( &rd );
+  }
+  free_reducer( &rd );
   return ( 0 );
 }
@@ -4,31 +4,248 @@ use strict;
 use warnings;
 
 use File::Spec;
+use File::Temp;
+use JSON::PP;
+use List::Util qw( shuffle sum );
 
 use Test::More;
 use Test::Differences;
 
 use constant TESTS => ( 1 .. 2 );
+use constant OPTIONS =>
+ ( '', '--threads 3', '--kernel table', '--radius 350 --threads 2',
+   '--sweep --threads 2', '--no-tile', '--early-abort --kernel scalar' );
 
-plan tests => TESTS * 1;
+plan tests => TESTS * ( OPTIONS + 22 ) + 4;
 
 for my $t ( TESTS ) {
-  test( "test$t" );
+  my ( $db, $ref, $knn )
+   = map { File::Spec->catfile( 't', 'data', "test$t.$_" ) } 'db', 'ref',
+   'knn';
+  my @want = slurp( $ref );
+
+  for my $opt ( OPTIONS ) {
+    eq_or_diff [ run( "./fdmf_dump --db $db | ./fdmf_correlator $opt" ) ],
+     \@want, "test$t $opt: output matches";
+  }
+
+  my $bin = File::Temp->new;
+  run( "./fdmf_dump --db $db | ./fdmf_correlator --binary $bin" );
+  eq_or_diff [ run( "./fdmf_correlator $bin" ) ], \@want,
+   "test$t binary dump: output matches";
+
+  my $stats = File::Temp->new;
+  eq_or_diff [ run( "./fdmf_correlator --stats $stats --threads 2 $bin" ) ],
+   \@want, "test$t --stats: output matches";
+  my $st = decode_json( join "\n", slurp( $stats ) );
+  is_deeply [
+    $st->{pairs}{examined},
+    sum( @{ $st->{distances} } ),
+    sum( map { $_->{evaluated} } @{ $st->{per_thread} } )
+   ],
+   [ $st->{pairs}{total}, ( $st->{pairs}{evaluated} ) x 2 ],
+   "test$t --stats: counts add up";
+
+  # The default kernel may have no bounded variant, so one that does is
+  # picked instead
+  run( "./fdmf_correlator --early-abort --keep 10 --stats $stats $bin" );
+  $st = decode_json( join "\n", slurp( $stats ) );
+  ok $st->{early_abort} && $st->{pairs}{aborted} > 0,
+   "test$t --early-abort: gives up early with the default kernel";
+
+  # No hash appears twice, so none are collapsed
+  my $count = () = run( "./fdmf_dump --db $db" );
+  ok +( grep { /Collapsed $count hashes to $count unique/ }
+     run( "./fdmf_correlator --verbose $bin 2>&1 >/dev/null" ) ),
+   "test$t: every hash is unique";
+
+  # Too few hashes for an index to pay, so every pair is compared but
+  # only those within the radius are kept
+  ok +( grep { /comparing every pair/ }
+     run( "./fdmf_correlator --verbose --radius 280 $bin 2>&1 >/dev/null" ) ),
+   "test$t --radius: compares every pair";
+  eq_or_diff [ run( "./fdmf_correlator --radius 280 --threads 2 $bin" ) ],
+   [ grep { ( split )[0] <= 280 } @want ],
+   "test$t --radius: only pairs within the radius";
+
+  eq_or_diff [ run( "./fdmf_correlator --budget 1 --threads 2 $bin" ) ],
+   \@want, "test$t --budget: output matches";
+
+  my @report = run( "./fdmf_correlator $bin | ./fdmf_report --db $db" );
+  eq_or_diff [
+    run(
+      "./fdmf_correlator --output index $bin"
+       . " | ./fdmf_report --db $db --hashes $bin"
+    )
+   ],
+   \@report, "test$t --output index: report matches";
+  eq_or_diff [
+    run(
+      "./fdmf_correlator --output binary $bin"
+       . " | ./fdmf_report --db $db --hashes $bin --binary"
+    )
+   ],
+   \@report, "test$t --output binary: report matches";
+
+  eq_or_diff [ run( "./fdmf_correlator --knn 3 --threads 2 $bin" ) ],
+   [ slurp( $knn ) ], "test$t --knn 3: output matches";
+
+  my @all = run( "./fdmf_correlator --keep 1000000 $bin" );
+  my @near = grep { /^\s*(\d+)/ && $1 <= 300 } @all;
+  eq_or_diff [ run( "./fdmf_correlator --max-distance 300 --sort $bin" ) ],
+   \@near, "test$t --max-distance --sort: output matches";
+  eq_or_diff [
+    sort( run( "./fdmf_correlator --max-distance 300 --threads 3 $bin" ) )
+   ],
+   [ sort @near ], "test$t --max-distance: same pairs";
+
+  my %parent = ();
+  my $root = sub {
+    my $h = shift;
+    $h = $parent{$h} while $parent{$h} ne $h;
+    return $h;
+  };
+  for ( @near ) {
+    my ( undef, $this, $that ) = split;
+    $parent{$_} //= $_ for $this, $that;
+    $parent{ $root->( $this ) } = $root->( $that );
+  }
+  my %group = ();
+  push @{ $group{ $root->( $_ ) } }, $_ for keys %parent;
+  eq_or_diff [ canon_groups( run( "./fdmf_correlator --groups 300 $bin" ) ) ],
+   [ canon_groups( map { "@$_" } values %group ) ],
+   "test$t --groups: same groups";
+  my @far = grep {
+    my ( $lead, @rest ) = split;
+    grep { distance( $lead, $_ ) > 250 } @rest
+   } run(
+    "./fdmf_correlator --groups 300 --group-radius 250 --threads 2 $bin" );
+  eq_or_diff \@far, [], "test$t --group-radius: groups within radius";
+
+  my @shard = map { File::Temp->new } 1 .. 3;
+  eq_or_diff [
+    map { run( "./fdmf_correlator --shard $_/3 --save $shard[$_] $bin" ) }
+     0 .. $#shard
+   ],
+   [], "test$t --shard: writes nothing";
+  eq_or_diff [ run( "./fdmf_merge $bin @shard" ) ], \@want,
+   "test$t --shard: merged output matches";
+
+  # A text dump is read in reverse so adding the start of the dump as a
+  # delta to the rest of it gives the whole list back
+  my @dump = run( "./fdmf_dump --db $db" );
+  my ( $base, $delta, $state ) = map { File::Temp->new } 1 .. 3;
+  # The first 256 bits of each hash
+  my ( $short, $short_bin ) = map { File::Temp->new } 1 .. 2;
+  print $short map { substr( $_, 0, 64 ) . "\n" } @dump;
+  close $short;
+  run( "./fdmf_correlator --binary $short_bin $short" );
+  eq_or_diff [ run( "./fdmf_correlator --threads 2 $short_bin" ) ],
+   [ run( "./fdmf_correlator --kernel table --no-tile $short" ) ],
+   "test$t 256 bit hashes: output matches";
+
+  # Every third hash three times over
+  my $copies = File::Temp->new;
+  print $copies map { ( "$dump[$_]\n" ) x ( $_ % 3 ? 1 : 3 ) } 0 .. $#dump;
+  close $copies;
+  eq_or_diff [ run( "./fdmf_correlator --keep 300 --threads 2 $copies" ) ],
+   [ run( "./fdmf_correlator --keep 300 --no-dedup $copies" ) ],
+   "test$t copies: output matches";
+
+  my @new = splice @dump, 0, @dump / 3;
+  print $delta map { "$_\n" } @new;
+  print $base map  { "$_\n" } @dump;
+  close $_ for $base, $delta;
+  run( "./fdmf_correlator --save $state $base" );
+  eq_or_diff [
+    run(
+      "./fdmf_correlator --previous $state --delta $delta --threads 2 $base"
+    )
+   ],
+   \@want, "test$t --delta: output matches";
+
+  my %is_new = map { $_ => 1 } @new;
+  my @cross = grep {
+    my ( undef, $this, $that ) = split;
+    $is_new{$this} xor $is_new{$that}
+  } @all;
+  eq_or_diff [
+    run(
+      "./fdmf_correlator --keep 1000000 --query $delta --threads 2 $base"
+    )
+   ],
+   \@cross, "test$t --query: output matches";
+
+  # The dump stays mapped while the queries are read apart from it
+  my $base_bin = File::Temp->new;
+  run( "./fdmf_correlator --binary $base_bin $base" );
+  eq_or_diff [
+    run(   "./fdmf_correlator --keep 1000000 --query $delta --radius 350 "
+         . "--threads 2 $base_bin" )
+   ],
+   [ grep { ( split )[0] <= 350 } @cross ],
+   "test$t --query --radius: output matches";
 }
 
-sub test {
-  my $test = shift;
-  my ( $db, $ref )
-   = map { File::Spec->catfile( 't', 'data', "$test.$_" ) } 'db', 'ref';
+{
+  # Enough hashes in tight clusters for an index to pay at radius 40
+  srand 1;
+  my @gen;
+  for ( 1 .. 500 ) {
+    my $centre = join '', map { sprintf '%08x', int rand 2**32 } 1 .. 24;
+    for ( 1 .. 4 ) {
+      my $bits = pack 'H*', $centre;
+      vec( $bits, int rand 768, 1 ) ^= 1 for 1 .. 10;
+      push @gen, unpack 'H*', $bits;
+    }
+  }
+  @gen = shuffle @gen;
+
+  my ( $all, $ref, $query, $ref_bin ) = map { File::Temp->new } 1 .. 4;
+  print $all map   { "$_\n" } @gen;
+  print $ref map   { "$_\n" } @gen[ 0 .. 1499 ];
+  print $query map { "$_\n" } @gen[ 1500 .. $#gen ];
+  close $_ for $all, $ref, $query;
+  run( "./fdmf_correlator --binary $ref_bin $ref" );
+
+  my @near = grep { ( split )[0] <= 40 }
+   run( "./fdmf_correlator --keep 100000 $all" );
+  ok +( grep { /^Indexed/ }
+     run( "./fdmf_correlator --verbose --radius 40 $all 2>&1 >/dev/null" ) ),
+   "generated --radius: builds an index";
+  eq_or_diff [
+    run( "./fdmf_correlator --keep 100000 --radius 40 --threads 2 $all" ) ],
+   \@near, "generated --radius: output matches";
+  eq_or_diff [
+    run( "./fdmf_correlator --keep 100000 --radius 40 --query $query $ref_bin" )
+   ],
+   [ grep { ( split )[0] <= 40 }
+     run( "./fdmf_correlator --keep 100000 --query $query $ref_bin" ) ],
+   "generated --query --radius: output matches";
 
-  open my $ph, '-|', "./fdmf_dump --db $db | ./fdmf_correlator"
-   or die "Can't run pipe: $!\n";
+  # An index this fine would probe millions of keys per hash
+  eq_or_diff [
+    run(   "./fdmf_correlator --keep 100000 --radius 40 --parts 12 $all "
+         . "2>/dev/null" )
+   ],
+   \@near, "generated --parts: falls back to comparing every pair";
+}
+
+sub run {
+  my $cmd = shift;
+  open my $ph, '-|', $cmd or die "Can't run pipe: $!\n";
   chomp( my @got = <$ph> );
   close $ph or die "Can't run pipe: $!\n";
+  return @got;
+}
 
-  my @want = slurp( $ref );
+sub canon_groups {
+  return sort map { join ' ', sort split } @_;
+}
 
-  eq_or_diff \@got, \@want, "$test: output matches";
+sub distance {
+  my ( $this, $that ) = map { pack 'H*', $_ } @_;
+  return unpack '%32b*', $this ^ $that;
 }
 
 sub slurp {
@@ -39,4 +256,3 @@ sub slurp {
 }
 
 # vim:ts=2:sw=2:et:ft=perl
-
@@ -0,0 +1,135 @@
+#!perl
+
+use strict;
+use warnings;
+
+use File::Spec;
+use File::Temp;
+
+use Test::More;
+
+plan skip_all => 'fdmf_sonic_reducer not built'
+ unless -x './fdmf_sonic_reducer';
+
+my $spline = find_spline();
+
+plan tests => 6;
+
+srand 1;
+
+{
+  # With spline's default boundary condition quadratics come out exact
+  my @pt = points( sub { 3 * $_[0] * $_[0] - 2 * $_[0] + 1 } );
+  my @got = fit( './fdmf_sonic_reducer --spline', @pt );
+  my ( $lo, $hi ) = ( $pt[0][0], $pt[-1][0] );
+  my @want
+   = map { my $x = $lo + $_ * ( $hi - $lo ) / 255; 3 * $x * $x - 2 * $x + 1 }
+   0 .. 255;
+  ok close_to( \@got, \@want, 1e-5 ), '--spline: quadratic is exact';
+}
+
+# A sine and something like the spectra the reducer fits, each with the
+# output of spline -I a -n 255 -s in t/data/spline*.out
+for my $name ( 'spline1', 'spline2' ) {
+  my @pt = read_points( "t/data/$name.in" );
+  my @want = read_values( "t/data/$name.out" );
+  my @got = fit( './fdmf_sonic_reducer --spline', @pt );
+  ok close_to( \@got, \@want, 1e-4 ), "--spline: matches $name.out";
+}
+
+SKIP: {
+  skip 'no spline to compare with', 2 unless defined $spline;
+  for my $name ( 'spline1', 'spline2' ) {
+    my @pt = read_points( "t/data/$name.in" );
+    my @want = fit( "$spline -I a -n 255 -s", @pt );
+    my @got = fit( './fdmf_sonic_reducer --spline', @pt );
+    ok close_to( \@got, \@want, 1e-4 ), "--spline: matches spline on $name";
+  }
+}
+
+{
+  # 40 seconds of something like music
+  my $audio = File::Temp->new;
+  binmode $audio;
+  print $audio map {
+    my $v = int( 8000 * sin( $_ * 0.05 ) * ( 1 + sin( $_ / 30000 ) )
+       + rand 6000 );
+    pack 's<s<', $v, -$v / 3
+  } 0 .. 40 * 11025 - 1;
+  close $audio;
+  my @data = run( "./fdmf_sonic_reducer < $audio" );
+  my $want = unpack 'H*', pack 'b*', join '',
+   map { quantize( @data[ $_ * 256 .. $_ * 256 + 255 ] ) } 0 .. 2;
+  is_deeply [ run( "./fdmf_sonic_reducer --format hex < $audio" ) ],
+   [$want], '--format hex: same hash as fdmf made';
+}
+
+# Points at ragged intervals from 0 to about 0.5
+sub points {
+  my $f = shift;
+  my ( $x, @pt ) = 0;
+  while ( $x < 0.5 ) {
+    push @pt, [ sprintf( '%f', $x ), sprintf( '%f', $f->( $x ) ) ];
+    $x += 0.002 + rand 0.01;
+  }
+  return @pt;
+}
+
+sub read_points {
+  return map { [split] } read_values( shift );
+}
+
+sub read_values {
+  my $name = shift;
+  open my $fh, '<', $name or die "Can't read $name: $!\n";
+  chomp( my @v = <$fh> );
+  return @v;
+}
+
+sub fit {
+  my ( $cmd, @pt ) = @_;
+  my $in = File::Temp->new;
+  print $in map { "@$_\n" } @pt;
+  close $in;
+  return run( "$cmd < $in" );
+}
+
+# As fdmf did it before the reducer could
+sub quantize {
+  my @sorted = sort { $a <=> $b } @_;
+  my $median = $sorted[ @sorted / 2 ];
+  return map { $_ > $median ? 1 : 0 } @_;
+}
+
+sub run {
+  my $cmd = shift;
+  open my $ph, '-|', $cmd or die "Can't run pipe: $!\n";
+  chomp( my @got = <$ph> );
+  close $ph or die "Can't run pipe: $!\n";
+  return @got;
+}
+
+# Every value within tol of the range of the values wanted
+sub close_to {
+  my ( $got, $want, $tol ) = @_;
+  return unless @$got == @$want;
+  my ( $lo, $hi ) = ( sort { $a <=> $b } @$want )[ 0, -1 ];
+  my $scale = $hi - $lo || 1;
+  for my $i ( 0 .. $#$want ) {
+    if ( abs( $got->[$i] - $want->[$i] ) > $tol * $scale ) {
+      diag "value $i: got $got->[$i], want $want->[$i]";
+      return;
+    }
+  }
+  return 1;
+}
+
+sub find_spline {
+  for my $dir ( File::Spec->path ) {
+    my $try = File::Spec->catfile( $dir, 'spline' );
+    return $try if -x $try;
+  }
+  return;
+}
+
+# vim:ts=2:sw=2:et:ft=perl